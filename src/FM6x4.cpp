@@ -2,7 +2,12 @@
 #include "dsp/digital.hpp"
 #include "utils/bidischmitttrigger.hpp"
 #include "utils/componentlibrary.hpp"
+#include "utils/governor.hpp"
+#include "utils/paramsnapshot.hpp"
+#include "utils/recorder.hpp"
+#include "utils/registerwritelist.hpp"
 #include "oplregisters.hpp"
+#include "fm6x4patch.hpp"
 #include <list>
 
 // #include <iostream>
@@ -14,29 +19,25 @@
 #include "deps/adlmidi/src/dbopl.h"
 #pragma GCC diagnostic pop
 
+#include "utils/oplrenderer.hpp"
+#include "utils/chipprototype.hpp"
+
 static const unsigned int kGenericLearnableParams = 6;
 static const unsigned int kPerChannelLearnableParams = 2;
 static const unsigned int kTotalLearnableParams = kGenericLearnableParams + kPerChannelLearnableParams;
-
-struct FM6x4 : Module {
+// At Governor::COARSE_PARAMS, parameters are only refreshed once every
+// this many blocks.
+static const unsigned int kCoarseRefreshBlocks = 4;
+// At Governor::SUSPEND_IDLE, rendering stops after this many blocks
+// (about 1.5s) with no gate and no sound.
+static const unsigned int kIdleBlocks = 2048;
+
+struct FM6x4 : Module, FM6x4Patch {
   enum ParamIds {
-    ALGORITHM_PARAM,
-    ENUMS(TREMOLO_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(VIBRATO_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(SUSTAIN_TOGGLE_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(KSR_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(MULTI_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(KSL_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(ATTENUATION_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(WAVEFORM_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(ATTACK_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(DECAY_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(SUSTAIN_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-    ENUMS(RELEASE_PARAM, OPL3::FourOP::kOperatorsPerChannel),
-
-    NUM_SAVEABLE_PARAMS, // The params below this can't be saved/automated by CV
-
-    ENUMS(LEARN_PARAM, kTotalLearnableParams),
+    // The params before these are FM6x4Patch::PatchParamIds. The params
+    // below can't be saved/automated by CV.
+    LEARN_PARAM = NUM_SAVEABLE_PARAMS,
+    LEARN_PARAM_LAST = LEARN_PARAM + kTotalLearnableParams - 1,
     UNLEARN_PARAM,
     NUM_PARAMS
   };
@@ -51,6 +52,7 @@ struct FM6x4 : Module {
   enum OutputIds {
     LEFT_OUTPUT,
     RIGHT_OUTPUT,
+    ENUMS(CHANNEL_OUTPUT, OPL3::kChannels),
     NUM_OUTPUTS
   };
   enum LightIds {
@@ -61,7 +63,17 @@ struct FM6x4 : Module {
     NUM_LIGHTS
   };
 
-  DBOPL::Handler opl_;
+  // Initial chip state shared by all instances running at the same
+  // sample rate.
+  unsigned int rate_;
+  const DBOPL::Handler* prototype_;
+  OPLRenderer opl_;
+  // Register writes computed during this step, applied to the chip
+  // right before rendering.
+  RegisterWriteList<256> pendingWrites_;
+  bool writeAllRegisters_ = true;
+  // Whether any per-channel output is connected, updated once per block.
+  bool splitChannels_ = false;
 
   // Parameter learning stuff
   enum LearningStatus {
@@ -77,6 +89,26 @@ struct FM6x4 : Module {
   unsigned int nstep = 0;
   float paramsSavedValues[NUM_SAVEABLE_PARAMS];
 
+  // Parameter values as last published by the UI thread. The engine
+  // thread only reads params through this, once per block.
+  ParamSnapshot<NUM_PARAMS> snapshot_;
+  // Learned routings restored from a patch, applied by the engine
+  // thread at the start of the next block.
+  int restoredLearnedParams_[NUM_SAVEABLE_PARAMS];
+  std::atomic<bool> hasRestoredLearnedParams_{false};
+  // Set by reset() on the UI thread, handled by the engine thread.
+  std::atomic<bool> resetRequested_{false};
+
+  GovernedInstance governor_;
+  unsigned int blocks_ = 0;
+  // Whether parameters are read during this block.
+  bool refreshParams_ = true;
+  int32_t peak_ = 0;
+  unsigned int silentBlocks_ = 0;
+  bool suspended_ = false;
+
+  Recorder recorder_;
+
   float kColorForLearningChannel[10][3] = {
     {0.0f, 0.0f, 0.0f}, // NOT_LEARNING
     {1.0f, 0.0f, 0.0f}, // LEARNING 0 through 7
@@ -91,7 +123,10 @@ struct FM6x4 : Module {
   };
 
   FM6x4() :
-    Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
+    Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS),
+    rate_((unsigned int)engineGetSampleRate()),
+    prototype_(&ChipPrototypes::get(rate_, programInitialRegisters)),
+    opl_(*prototype_, rate_)
   {
     // In 6x4 mode we enable 6 4-op channels.
     // For each channel, there are 4 operators (ops: A, B, C, D)
@@ -104,56 +139,96 @@ struct FM6x4 : Module {
     // We treat all voices as the same instrument, so it's a single 6-voices instrument.
     // This means that all writes that affect an operator are done 6 times, for each operator.
 
-    runInitialBytecode();
-
     for (auto& lp : learnedParams) {
       lp = -1;
     }
   }
 
   void reset() override {
-    runInitialBytecode();
+    resetRequested_ = true;
+  }
+
+  // Called while the engine is paused. The chip is reinitialized at
+  // the new rate at the next step, like on reset.
+  void onSampleRateChange() override {
+    rate_ = (unsigned int)engineGetSampleRate();
+    prototype_ = &ChipPrototypes::get(rate_, programInitialRegisters);
+    resetRequested_ = true;
+  }
+
+  // Only run once per process and sample rate, to build the prototype
+  // that all instances copy.
+  static void programInitialRegisters(DBOPL::Handler& opl) {
+    RegisterWriteList<1024> writes;
+    FM6x4Patch::programInitialRegisters(writes);
+    writes.applyTo(opl);
   }
 
   void runInitialBytecode() {
-    opl_.Init(44100); // TODO handle other rates!
+    opl_.loadState(*prototype_, rate_);
+    writeAllRegisters_ = true;
+  }
+
+  // Called from the UI thread.
+  void publishParams() {
+    float values[NUM_PARAMS];
+    for (unsigned int i = 0; i < NUM_PARAMS; ++i) {
+      values[i] = params[i].value;
+    }
+    snapshot_.publish(values);
+  }
+
+  json_t* toJson() override {
+    json_t* rootJ = json_object();
+    json_t* learnedJ = json_array();
+    for (int lp : learnedParams) {
+      json_array_append_new(learnedJ, json_integer(lp));
+    }
+    json_object_set_new(rootJ, "learnedParams", learnedJ);
+    json_object_set_new(rootJ, "pipelined", json_boolean(opl_.isPipelinedRequested()));
+    json_object_set_new(rootJ, "qualityLock", json_integer(governor_.lockedLevel()));
+    return rootJ;
+  }
 
-    // Init code
-    for (unsigned int i = 0x00; i < 0x300; ++i) {
-      opl_.WriteReg(i, 0x00);
+  void fromJson(json_t* rootJ) override {
+    opl_.setPipelined(json_is_true(json_object_get(rootJ, "pipelined")));
+    json_t* lockJ = json_object_get(rootJ, "qualityLock");
+    if (lockJ) {
+      int level = (int)json_integer_value(lockJ);
+      governor_.lock(level < Governor::NUM_LEVELS ? level : -1);
     }
-    opl_.WriteReg(0x01, 1<<5); // Enable waveform selection per operator
-    opl_.WriteReg(0x105, 0x01); // Enable OPL3 features
-    opl_.WriteReg(0x104, 0xff); // Enable 4-OP for all 6 channels
+    json_t* learnedJ = json_object_get(rootJ, "learnedParams");
+    if (!learnedJ) {
+      return;
+    }
+    for (unsigned int p = 0; p < NUM_SAVEABLE_PARAMS; ++p) {
+      json_t* lpJ = json_array_get(learnedJ, p);
+      int lp = lpJ ? (int)json_integer_value(lpJ) : -1;
+      restoredLearnedParams_[p] = (lp >= 0 && lp < (int)kTotalLearnableParams) ? lp : -1;
+    }
+    hasRestoredLearnedParams_.store(true, std::memory_order_release);
   }
 
-  void writeRegister(unsigned int reg, uint8_t value) {
-    opl_.WriteReg(reg, value);
+  // Parameter source for FM6x4Patch.
+  float paramValue(int param) const {
+    return snapshot_.values[param];
   }
 
-  uint8_t getScaledParam(int param, float maxvalue, uint8_t mask, unsigned int channel) {
-    float value = 0.f;
-    if (learnedParams[param] != -1) {
-      if (learnedParams[param] == 6) { // "parameter CVs" 6 and 7 are per-channel
-	value = clamp(inputs[PER_CHANNEL_PARAMETER_A_INPUT + channel].value, 0.f, 10.f);
-      } else if (learnedParams[param] == 7) {
-	value = clamp(inputs[PER_CHANNEL_PARAMETER_B_INPUT + channel].value, 0.f, 10.f);
-      } else {
-	value = clamp(inputs[GENERIC_PARAMETER_INPUT + learnedParams[param]].value, 0.f, 10.f) / 10.f * maxvalue;
-      }
+  float paramModulation(int param, float maxvalue, unsigned int channel) const {
+    if (learnedParams[param] == -1) {
+      return 0.f;
     }
-    value += params[param].value;
-    value = clamp(value, 0.f, 10.f);
-    value /= maxvalue;
-    if (value < 0.f) {
-      return (uint8_t)(0);
+    if (learnedParams[param] == 6) { // "parameter CVs" 6 and 7 are per-channel
+      return clamp(inputs[PER_CHANNEL_PARAMETER_A_INPUT + channel].value, 0.f, 10.f);
+    } else if (learnedParams[param] == 7) {
+      return clamp(inputs[PER_CHANNEL_PARAMETER_B_INPUT + channel].value, 0.f, 10.f);
     }
-    return static_cast<uint8_t>(round((float)mask * value));
+    return clamp(inputs[GENERIC_PARAMETER_INPUT + learnedParams[param]].value, 0.f, 10.f) / 10.f * maxvalue;
   }
 
   void saveAllParams() {
     for (unsigned int i = 0; i < NUM_SAVEABLE_PARAMS; ++i) {
-      paramsSavedValues[i] = params[i].value;
+      paramsSavedValues[i] = snapshot_.values[i];
     }
   }
 
@@ -161,12 +236,26 @@ struct FM6x4 : Module {
     learningStatus_ = l;
   }
 
-  void step() override {
-    nstep++;
+  void setLearnedParam(unsigned int p, int source) {
+    learnedParams[p] = source;
+    // Learned inputs are numbered from 0 while learning statuses start
+    // at LEARNING, which is also how the color table is indexed.
+    const float* color = kColorForLearningChannel[source == -1 ? NOT_LEARNING : LEARNING + source];
+    lights[LEARNED_PARAM_LIGHT + p * 3].setBrightness(color[0]);
+    lights[LEARNED_PARAM_LIGHT + p * 3 + 1].setBrightness(color[1]);
+    lights[LEARNED_PARAM_LIGHT + p * 3 + 2].setBrightness(color[2]);
+  }
+
+  // Runs once per block, on the latest parameter snapshot.
+  void processLearning() {
+    if (hasRestoredLearnedParams_.exchange(false, std::memory_order_acquire)) {
+      for (unsigned int p = 0; p < NUM_SAVEABLE_PARAMS; ++p) {
+	setLearnedParam(p, restoredLearnedParams_[p]);
+      }
+    }
 
-    // Learning params
     for (int i = 0; i < 8; ++i) {
-      if (learningButton[i].process(params[LEARN_PARAM + i].value)) {
+      if (learningButton[i].process(snapshot_.values[LEARN_PARAM + i])) {
 	if (learningStatus_ == LearningStatus::LEARNING + i) {
 	  setLearningStatus(LearningStatus::NOT_LEARNING);
 	} else {
@@ -175,7 +264,7 @@ struct FM6x4 : Module {
 	}
       }
     }
-    if (unlearningButton.process(params[UNLEARN_PARAM].value)) {
+    if (unlearningButton.process(snapshot_.values[UNLEARN_PARAM])) {
       if (learningStatus_ == LearningStatus::UNLEARNING) {
 	setLearningStatus(LearningStatus::NOT_LEARNING);
       } else {
@@ -185,18 +274,11 @@ struct FM6x4 : Module {
     }
     if (learningStatus_ != LearningStatus::NOT_LEARNING) {
       for (unsigned int p = 0; p < NUM_SAVEABLE_PARAMS; ++p) {
-	if (paramsSavedValues[p] != params[p].value) {
+	if (paramsSavedValues[p] != snapshot_.values[p]) {
 	  if (learningStatus_ == LearningStatus::UNLEARNING) {
-	    learnedParams[p] = -1;
-	    lights[LEARNED_PARAM_LIGHT + p * 3].setBrightness(0.f);
-	    lights[LEARNED_PARAM_LIGHT + p * 3 + 1].setBrightness(0.f);
-	    lights[LEARNED_PARAM_LIGHT + p * 3 + 2].setBrightness(0.f);
+	    setLearnedParam(p, -1);
 	  } else {
-	    unsigned int s = learningStatus_ - LearningStatus::LEARNING;
-	    learnedParams[p] = s;
-	    lights[LEARNED_PARAM_LIGHT + p * 3].setBrightness(kColorForLearningChannel[learningStatus_][0]);
-	    lights[LEARNED_PARAM_LIGHT + p * 3 + 1].setBrightness(kColorForLearningChannel[learningStatus_][1]);
-	    lights[LEARNED_PARAM_LIGHT + p * 3 + 2].setBrightness(kColorForLearningChannel[learningStatus_][2]);
+	    setLearnedParam(p, learningStatus_ - LearningStatus::LEARNING);
 	  }
 	  setLearningStatus(LearningStatus::NOT_LEARNING);
 	  break;
@@ -206,153 +288,143 @@ struct FM6x4 : Module {
     lights[LEARNING_LIGHT_R].setBrightness(kColorForLearningChannel[learningStatus_][0]);
     lights[LEARNING_LIGHT_G].setBrightness(kColorForLearningChannel[learningStatus_][1]);
     lights[LEARNING_LIGHT_B].setBrightness(kColorForLearningChannel[learningStatus_][2]);
+  }
 
-    //// Configure the chip
-    // 21	Operator 1	Tremolo/Vibrato/Sustain/KSR/Multiplication
-    // 24	Operator 2	Tremolo/Vibrato/Sustain/KSR/Multiplication
-    // 29	Operator 3	Tremolo/Vibrato/Sustain/KSR/Multiplication
-    // 2C	Operator 4	Tremolo/Vibrato/Sustain/KSR/Multiplication
-    if (nstep == 1) {
-      for (unsigned int op = 0; op < 4; ++op) {
-	for (unsigned int ch = 0; ch < 6; ++ch) {
-	  OPL3::OperatorConfigEffects o{
-	  tremolo: getScaledParam(TREMOLO_PARAM + op, 1.0, 0x1, ch),
-	      vibrato: getScaledParam(VIBRATO_PARAM + op, 1.0, 0x1, ch),
-	      sustain: getScaledParam(SUSTAIN_TOGGLE_PARAM + op, 1.0, 0x1, ch),
-	      ksr: getScaledParam(KSR_PARAM + op, 1.0, 0x1, ch),
-	      multi: getScaledParam(MULTI_PARAM + op, 15.0, 0xf, ch),
-	      };
-	  writeRegister(OPL3::OperatorRegister(0x20, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
-	}
-      }
+  // Writes the registers computed from one group of parameters. The
+  // groups are normally spread over the first steps of each block.
+  void writeRegisterGroup(unsigned int group) {
+    FM6x4Patch::writeRegisterGroup(group, *this, pendingWrites_);
+  }
+
+  // Decides how much work this block gets, from the quality level
+  // the governor picked.
+  void startBlock() {
+    int level = governor_.level();
+    refreshParams_ = level < Governor::COARSE_PARAMS || writeAllRegisters_ || (++blocks_ % kCoarseRefreshBlocks) == 0;
+
+    if (gatesHigh()) {
+      silentBlocks_ = 0;
     }
+    bool suspend = level >= Governor::SUSPEND_IDLE && silentBlocks_ >= kIdleBlocks;
+    if (suspended_ && !suspend) {
+      resume();
+    }
+    suspended_ = suspend;
 
-    // 41	Operator 1	Key Scale Level/Output Level
-    // 44	Operator 2	Key Scale Level/Output Level
-    // 49	Operator 3	Key Scale Level/Output Level
-    // 4C	Operator 4	Key Scale Level/Output Level
-    if (nstep == 2) {
-      for (unsigned int op = 0; op < 4; ++op) {
-	for (unsigned int ch = 0; ch < 6; ++ch) {
-	  OPL3::OperatorConfigLevels o{
-	  ksl: getScaledParam(KSL_PARAM + op, 1.0, 0x1, ch),
-	      level: getScaledParam(ATTENUATION_PARAM + op, 1.0, 0x1, ch),
-	      };
-	  writeRegister(OPL3::OperatorRegister(0x40, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
-	}
-      }
+    if (refreshParams_) {
+      snapshot_.consume();
+      processLearning();
+    }
+    splitChannels_ = false;
+    for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+      splitChannels_ = splitChannels_ || outputs[CHANNEL_OUTPUT + ch].active;
     }
+  }
 
-    // 61	Operator 1	Attack Rate/Decay Rate
-    // 64	Operator 2	Attack Rate/Decay Rate
-    // 69	Operator 3	Attack Rate/Decay Rate
-    // 6C	Operator 4	Attack Rate/Decay Rate
-    if (nstep == 3) {
-      for (unsigned int op = 0; op < 4; ++op) {
-	for (unsigned int ch = 0; ch < 6; ++ch) {
-	  OPL3::OperatorConfigAtkDec o{
-	  attack: getScaledParam(ATTACK_PARAM + op, 15.0, 0xf, ch),
-	      decay: getScaledParam(DECAY_PARAM + op, 15.0, 0xf, ch),
-	      };
-	  writeRegister(OPL3::OperatorRegister(0x60, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
-	}
+  bool gatesHigh() {
+    for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+      if (keyOn[ch].state || inputs[GATE_INPUT + ch].value > 0.1f) {
+	return true;
       }
     }
+    return false;
+  }
 
-    // 81	Operator 1	Sustain Level/Release Rate
-    // 84	Operator 2	Sustain Level/Release Rate
-    // 89	Operator 3	Sustain Level/Release Rate
-    // 8C	Operator 4	Sustain Level/Release Rate
-    if (nstep == 4) {
-      for (unsigned int op = 0; op < 4; ++op) {
-	for (unsigned int ch = 0; ch < 6; ++ch) {
-	  OPL3::OperatorConfigSusRel o{
-	  sustain: getScaledParam(SUSTAIN_PARAM + op, 15.0, 0xf, ch),
-	      release: getScaledParam(RELEASE_PARAM + op, 15.0, 0xf, ch),
-	      };
-	  writeRegister(OPL3::OperatorRegister(0x80, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
-	}
-      }
+  void resume() {
+    suspended_ = false;
+    silentBlocks_ = 0;
+    // Parameters may have moved while suspended.
+    writeAllRegisters_ = true;
+    refreshParams_ = true;
+  }
+
+  void endBlock() {
+    if (peak_ > 0) {
+      silentBlocks_ = 0;
+    } else if (silentBlocks_ < kIdleBlocks) {
+      silentBlocks_++;
     }
+    peak_ = 0;
+  }
 
-    // C1		FeedBack/Synthesis Type (part 1)
-    // C4		Synthesis Type (part 2)
-    if (nstep == 5) {
-      unsigned int algorithm = static_cast<unsigned int>(clamp(params[ALGORITHM_PARAM].value, 0.0f, 4.0f));
-      uint8_t feedback = 0x00; // TODO: implement feedback. Only affects operator 1 of each algorithm, ignored for other operators.
-
-      OPL3::ChannelConfigSynthesis c_primary{
-      outch_d: false,  // We don't use the extra channels C and D
-	  outch_c: false,
-	  outch_r: true, // TODO?
-	  outch_l: true,
-	  feedback: feedback, // TODO!
-	  synthtype: (uint8_t)(algorithm & 1), // safe cast: x&1 fits on 1 bit
-	  };
-      OPL3::ChannelConfigSynthesis c_secondary{
-      outch_d: false,
-	  outch_c: false,
-	  outch_r: false, // L, R and feedback are ignored for secondary channel config
-	  outch_l: false,
-	  feedback: 0,
-	  synthtype: (uint8_t)((algorithm & 2) >> 1), // safe cast: ((x>>2)&1) fits on 1 bit
-	  };
+  void step() override {
+    governor_.beginStep();
+    if (resetRequested_.exchange(false)) {
+      runInitialBytecode();
+    }
+
+    nstep++;
+
+    bool resumed = false;
+    if (nstep == 1) {
+      startBlock();
+    } else if (suspended_ && gatesHigh()) {
+      // Gates are polled on every step while suspended, so that a
+      // gate or trigger arriving mid-block is played on this step
+      // rather than missed or delayed until the next block.
+      resume();
+      snapshot_.consume();
+      processLearning();
+      resumed = true;
+    }
+
+    if (suspended_) {
+      outputs[LEFT_OUTPUT].value = 0.f;
+      outputs[RIGHT_OUTPUT].value = 0.f;
       for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
-	writeRegister(OPL3::ChannelRegister(0xC0, OPL3::FourOP::kHWChannels[ch]), c_primary.value()); // Set synthesis type & feedback for channel 0
-	writeRegister(OPL3::ChannelRegister(0xC0, OPL3::FourOP::kHWChannels[ch] + 3), c_secondary.value()); // Same for shadow channel 3
+	outputs[CHANNEL_OUTPUT + ch].value = 0.f;
       }
+      recorder_.write(0, 0);
+    } else {
+      renderStep(resumed);
     }
 
-    // E1	Operator 1	Waveform Select
-    // E4	Operator 2	Waveform Select
-    // E9	Operator 3	Waveform Select
-    // EC	Operator 4	Waveform Select
-    if (nstep == 6) {
-      for (unsigned int op = 0; op < 4; ++op) {
-	for (unsigned int ch = 0; ch < 6; ++ch) {
-	  OPL3::OperatorConfigWaveform o{
-	  waveform: getScaledParam(WAVEFORM_PARAM + op, 7.0f, 0x7, ch),
-	      };
-	  writeRegister(OPL3::OperatorRegister(0xE0, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
-	}
-      }
+    if (nstep >= 32) {
+      endBlock();
+      nstep = 0;
     }
+    governor_.endStep(OPLRenderer::kBlockSize);
+  }
 
-    // A1		Frequency Number (low)
-    // A4		Unused
-    // B1		Key On/Block Number/Frequency Number (high)
-    // B4		Unused
-    if (nstep == 7) {
-      for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
-	if (keyOn[ch].process(inputs[GATE_INPUT + ch].value)) {
-	  OPL3::Note n{};
-	  bool send_keyon = keyOn[ch].state && n.computeOPLParamsFromCV(inputs[CV_INPUT + ch].value);
-	  OPL3::ChannelConfigNote o{};
-	  o.A.freqlow8bits = n.freqLo;
-	  o.B.keyon = send_keyon;
-	  o.B.block = n.block;
-	  o.B.freqhi2bits = n.freqHi;
-
-	  writeRegister(OPL3::ChannelRegister(0xA0, OPL3::FourOP::kHWChannels[ch]), o.A.value());
-	  writeRegister(OPL3::ChannelRegister(0xA0, OPL3::FourOP::kHWChannels[ch] + 3), o.A.value());
-	  writeRegister(OPL3::ChannelRegister(0xB0, OPL3::FourOP::kHWChannels[ch]), o.B.value());
-	  writeRegister(OPL3::ChannelRegister(0xB0, OPL3::FourOP::kHWChannels[ch] + 3), o.B.value());
-	}
+  void processNotes() {
+    for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+      if (keyOn[ch].process(inputs[GATE_INPUT + ch].value)) {
+	FM6x4Patch::writeNote(ch, keyOn[ch].state, inputs[CV_INPUT + ch].value, pendingWrites_);
       }
     }
+  }
 
-    if (nstep >= 8) {
-      if (nstep >= 32) {
-	nstep = 0;
+  // resumed is set when the module was suspended until this step.
+  void renderStep(bool resumed) {
+    if (writeAllRegisters_ && (nstep == 1 || resumed)) {
+      // Program the whole patch at once after a reset.
+      for (unsigned int group = 1; group <= 6; ++group) {
+	writeRegisterGroup(group);
       }
+      writeAllRegisters_ = false;
+    } else if (nstep <= 6 && refreshParams_) {
+      writeRegisterGroup(nstep);
+    }
+
+    if (nstep == 7 || resumed) {
+      processNotes();
     }
 
     //// Synthesize sound
-    static const int kSamples = 1;
-    int32_t buf[kSamples * 2]; // 2 channels
-    opl_.chip.GenerateBlock3(kSamples, buf);
+    int32_t buf[2]; // 2 channels
+    int32_t channels[kChipChannels];
+    pendingWrites_.applyTo(opl_);
+    pendingWrites_.clear();
+    opl_.generate(buf, splitChannels_ ? channels : nullptr);
+    recorder_.write(buf[0], buf[1]);
     outputs[LEFT_OUTPUT].value = (float)buf[0] / (float)0x7fff * 10.f;
     outputs[RIGHT_OUTPUT].value = (float)buf[1] / (float)0x7fff * 10.f;
+    peak_ = std::max(peak_, std::max(std::abs(buf[0]), std::abs(buf[1])));
+    if (splitChannels_) {
+      for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+	outputs[CHANNEL_OUTPUT + ch].value = (float)channels[OPL3::FourOP::kHWChannels[ch]] / (float)0x7fff * 10.f;
+      }
+    }
   }
 };
 
@@ -436,6 +508,35 @@ struct FM6x4Widget : ModuleWidget {
     // Output
     addOutput(Port::create<PJ301MPort>(Vec(20, 300), Port::OUTPUT, module, FM6x4::LEFT_OUTPUT));
     addOutput(Port::create<PJ301MPort>(Vec(40, 320), Port::OUTPUT, module, FM6x4::RIGHT_OUTPUT));
+
+    // Per-channel outputs, one above each channel's gate input
+    for (unsigned int i = 0; i < 6; ++i) {
+      addOutput(Port::create<PJ301MPort>(Vec(80 + i * 30, 210), Port::OUTPUT, module, FM6x4::CHANNEL_OUTPUT + i));
+    }
+  }
+
+  void step() override {
+    module_->publishParams();
+    ModuleWidget::step();
+  }
+
+  void appendContextMenu(Menu* menu) override {
+    menu->addChild(MenuEntry::create());
+
+    struct PipelinedMenuItem : MenuItem {
+      FM6x4* module;
+
+      void onAction(EventAction& e) override {
+	module->opl_.setPipelined(!module->opl_.isPipelinedRequested());
+      }
+    };
+
+    PipelinedMenuItem* pipelined = MenuItem::create<PipelinedMenuItem>("Render on background thread", CHECKMARK(module_->opl_.isPipelinedRequested()));
+    pipelined->module = module_;
+    menu->addChild(pipelined);
+
+    appendGovernorMenu(menu, &module_->governor_);
+    appendRecorderMenu(menu, &module_->recorder_);
   }
 };
 
@@ -1,4 +1,5 @@
 #include "OPL33t.hpp"
+#include "dsp/digital.hpp"
 #include "osdialog.h"
 
 #pragma GCC diagnostic push
@@ -7,17 +8,26 @@
 #include "deps/adlmidi/src/dbopl.h"
 #pragma GCC diagnostic pop
 
+#include "utils/oplrenderer.hpp"
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsuggest-override"
 #pragma GCC diagnostic ignored "-Wignored-qualifiers"
 #include "deps/adplug/src/adplug.h"
+#include "deps/adplug/src/silentopl.h"
 #pragma GCC diagnostic pop
 
+#include "utils/filecache.hpp"
+#include "utils/governor.hpp"
+#include "utils/songindex.hpp"
+#include "utils/playlist.hpp"
+#include "utils/recorder.hpp"
+
 struct AdPlugOPLCompatibility : Copl {
-  DBOPL::Handler dbopl_;
+  OPLRenderer dbopl_;
   unsigned int rate_;
 
-  AdPlugOPLCompatibility(unsigned int rate) : Copl(), rate_(rate) {
+  AdPlugOPLCompatibility(unsigned int rate) : Copl(), dbopl_(rate), rate_(rate) {
     currType = ChipType::TYPE_OPL3;
     init();
   }
@@ -33,11 +43,154 @@ struct AdPlugOPLCompatibility : Copl {
   }
 
   virtual void update(short* buf, int samples) override {
-    int tmpbuf[samples * 2];
-    dbopl_.chip.GenerateBlock3((unsigned int)samples, tmpbuf);
     for (int i = 0; i < samples; ++i) {
-      buf[i*2] = tmpbuf[i];
-      buf[i*2 + 1] = tmpbuf[i];
+      int32_t tmpbuf[2];
+      dbopl_.generate(tmpbuf);
+      buf[i*2] = tmpbuf[0];
+      buf[i*2 + 1] = tmpbuf[0];
+    }
+  }
+};
+
+// A player together with the chip it drives. Player owns two decks:
+// one is playing while the other one is loaded in the background
+// with the next track of the playlist, so that switching tracks
+// doesn't have to wait for the file to be read and parsed.
+//
+// The state field hands a deck over between threads. The loader
+// thread only touches LOADING decks, the engine thread only touches
+// decks in any other state.
+struct PlayerDeck {
+  enum State {
+    EMPTY,
+    LOADING,
+    READY,
+    PLAYING,
+  };
+  std::atomic<int> state{EMPTY};
+
+  AdPlugOPLCompatibility opl_;
+  CPlayer* player_ = nullptr;
+  // Keeps the track file mapped while it's playing, so that other
+  // Players loading it share the mapping.
+  std::unique_ptr<CProvider_Mapped> provider_;
+  std::shared_ptr<const SongInfo> songInfo_;
+  int track_ = -1; // Index in the playlist
+  unsigned int subsong_ = 0;
+  float nextPlayerUpdateIn_ = 0.f;
+  float positionMs_ = 0.f;
+  bool wasPlaying_ = true;
+
+  PlayerDeck() : opl_(44100 /* rate */) {}
+
+  ~PlayerDeck() {
+    delete player_;
+  }
+
+  // Called on the loader thread.
+  void load(const std::string& path) {
+    opl_.dbopl_.restart();
+    delete player_;
+    provider_.reset(new CProvider_Mapped());
+    player_ = path.empty() ? nullptr : loadTrack(path, &opl_, *provider_);
+    songInfo_.reset();
+    if (player_) {
+      songInfo_ = SongIndexer::get().lookup(path);
+      subsong_ = clampSubsong(subsong_);
+      player_->rewind(subsong_);
+    } else {
+      opl_.init();
+    }
+    nextPlayerUpdateIn_ = 0.f;
+    positionMs_ = 0.f;
+    wasPlaying_ = true;
+  }
+
+  // Returns the index entry for this track once indexing is
+  // complete, nullptr otherwise.
+  const SongInfo* readySongInfo() const {
+    if (songInfo_ && songInfo_->ready.load(std::memory_order_acquire) && songInfo_->valid) {
+      return songInfo_.get();
+    }
+    return nullptr;
+  }
+
+  // Length of the current subsong, or 0 if it's unknown yet or if
+  // the subsong never ends.
+  unsigned long lengthMs() const {
+    const SongInfo* info = readySongInfo();
+    if (info && subsong_ < info->subsongs.size() && info->subsongs[subsong_].ends) {
+      return info->subsongs[subsong_].lengthMs;
+    }
+    return 0;
+  }
+
+  // Subsongs past the last one play the last one. load() and
+  // selectSubsong() must agree on this, or the first step() after a
+  // deck switch would rewind the new track.
+  unsigned int clampSubsong(unsigned int subsong) const {
+    return std::min(subsong, std::max(player_->getsubsongs(), 1u) - 1);
+  }
+
+  void selectSubsong(unsigned int subsong) {
+    if (!player_) {
+      return;
+    }
+    subsong = clampSubsong(subsong);
+    if (subsong != subsong_) {
+      subsong_ = subsong;
+      player_->rewind(subsong_);
+      positionMs_ = 0.f;
+      wasPlaying_ = true;
+      nextPlayerUpdateIn_ = 0.f;
+    }
+  }
+
+  // Advances the player by one sample. Returns true when the end of
+  // the track was reached.
+  bool step(float speed) {
+    if (!player_) {
+      return false;
+    }
+    bool ended = false;
+    nextPlayerUpdateIn_ -= engineGetSampleTime();
+    if (nextPlayerUpdateIn_ <= 0.f) {
+      bool playing = player_->update();
+      float refresh = player_->getrefresh();
+      positionMs_ += 1000.f / refresh;
+
+      // AdPlug players loop back on their own, but most of them keep
+      // reporting the end of the song afterwards. Once the length is
+      // known we rely on it instead.
+      unsigned long length = lengthMs();
+      if (length > 0 ? positionMs_ >= length : (!playing && wasPlaying_)) {
+	ended = true;
+	positionMs_ = length > 0 ? fmodf(positionMs_, length) : 0.f;
+      }
+      wasPlaying_ = playing;
+      nextPlayerUpdateIn_ = 1. / (speed * refresh);
+    }
+    return ended;
+  }
+
+  // If channels isn't null, it also receives the output of each OPL
+  // channel, rendered in the same pass.
+  void render(float* left, float* right, float* channels) {
+    if (!channels) {
+      static const int samples = 1;
+      short buf[samples * 2]; // 2 channels
+      opl_.update(buf, samples);
+      *left = (float)buf[0] / (float)0x7fff * 10.f;
+      *right = (float)buf[1] / (float)0x7fff * 10.f;
+      return;
+    }
+    int32_t buf[2];
+    int32_t split[kChipChannels];
+    opl_.dbopl_.generate(buf, split);
+    // Same conversion as AdPlugOPLCompatibility::update()
+    *left = *right = (float)(short)buf[0] / (float)0x7fff * 10.f;
+    for (unsigned int c = 0; c < kChipChannels; ++c) {
+      channels[c] = (float)split[c] / (float)0x7fff * 10.f;
     }
   }
 };
@@ -45,71 +198,342 @@ struct AdPlugOPLCompatibility : Copl {
 struct Player : Module {
   enum ParamIds {
     CLOCK_SPEED_PARAM,
+    SUBSONG_PARAM,
+    CROSSFADE_PARAM,
     NUM_PARAMS
   };
   enum InputIds {
     CLOCK_SPEED_INPUT,
+    SUBSONG_INPUT,
+    NEXT_INPUT,
+    PREV_INPUT,
+    RANDOM_INPUT,
     NUM_INPUTS
   };
   enum OutputIds {
     LEFT_OUTPUT,
     RIGHT_OUTPUT,
+    END_OF_TRACK_OUTPUT,
+    PROGRESS_OUTPUT,
+    ENUMS(CHANNEL_OUTPUT, kChipChannels),
     NUM_OUTPUTS
   };
   enum LightIds {
     NUM_LIGHTS
   };
 
-  //CTemuopl opl_;
-  AdPlugOPLCompatibility opl_;
-  CPlayer* player_ = nullptr;
-  float nextPlayerUpdateIn_ = 0.0f;
+  PlayerDeck decks_[2];
+  int active_ = 0;
+  PulseGenerator endOfTrackPulse_;
+  SchmittTrigger nextTrigger_;
+  SchmittTrigger prevTrigger_;
+  SchmittTrigger randomTrigger_;
+
+  // Crossfade progress from the previous deck to the active one, 1
+  // once the transition is over.
+  float fade_ = 1.f;
+  // Length of that crossfade, which is shorter than CROSSFADE_PARAM
+  // for short tracks.
+  float fadeSeconds_ = 0.f;
+  // In pipelined mode, a new deck starts with OPLRenderer::kLatency
+  // samples of silence while its first blocks are rendered. The
+  // previous deck keeps playing for that long to fill the gap.
+  unsigned int handoff_ = 0;
+  // Playlist index to jump to as soon as it's loaded, -1 if none.
+  int pendingTrack_ = -1;
+  bool switchWhenReady_ = false;
+
+  // The playlist is written by the UI thread and read by the loader
+  // thread. The engine thread only needs its size.
+  std::mutex playlistMutex_;
+  std::vector<std::string> playlist_;
+  std::atomic<int> playlistSize_{0};
+  std::atomic<int> requestedTrack_{-1};
+  // Entry for the active track, for the context menu.
+  std::shared_ptr<const SongInfo> displayedSongInfo_;
+
+  std::thread loader_;
+  std::mutex loaderMutex_;
+  std::condition_variable loaderCv_;
+  std::atomic<bool> stopping_{false};
+
+  GovernedInstance governor_;
+  unsigned int blockStep_ = 0;
+  // Refreshed every sample, or once per block at
+  // Governor::COARSE_PARAMS.
+  bool split_ = false;
+  unsigned int requestedSubsong_ = 0;
+
+  Recorder recorder_;
 
   Player() :
-    Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS),
-    opl_(44100 /* rate */)
+    Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS)
   {
+    loader_ = std::thread(&Player::runLoader, this);
+  }
+
+  ~Player() {
+    stopping_ = true;
+    loaderCv_.notify_one();
+    loader_.join();
+  }
+
+  bool transitioning() const {
+    return fade_ < 1.f || handoff_ > 0;
+  }
+
+  void setPipelined(bool pipelined) {
+    for (auto& deck : decks_) {
+      deck.opl_.dbopl_.setPipelined(pipelined);
+    }
+  }
+
+  bool isPipelined() const {
+    return decks_[0].opl_.dbopl_.isPipelinedRequested();
+  }
+
+  json_t* toJson() override {
+    json_t* rootJ = json_object();
+    json_object_set_new(rootJ, "pipelined", json_boolean(isPipelined()));
+    json_object_set_new(rootJ, "qualityLock", json_integer(governor_.lockedLevel()));
+    return rootJ;
+  }
+
+  void fromJson(json_t* rootJ) override {
+    setPipelined(json_is_true(json_object_get(rootJ, "pipelined")));
+    json_t* lockJ = json_object_get(rootJ, "qualityLock");
+    if (lockJ) {
+      int level = (int)json_integer_value(lockJ);
+      governor_.lock(level < Governor::NUM_LEVELS ? level : -1);
+    }
   }
 
   void reset() override {
-    opl_.init();
-    setPlaying("/dev/null");
+    // Index 0 of an empty playlist loads an empty deck, which stops
+    // playback.
+    setPlaylist({}, 0);
+  }
+
+  // Replaces the playlist and starts playing one of its tracks. Called
+  // from the UI thread.
+  void setPlaylist(std::vector<std::string> tracks, int start) {
+    SongIndexer::get().indexFiles(tracks);
+    {
+      std::lock_guard<std::mutex> lock(playlistMutex_);
+      playlist_ = std::move(tracks);
+      playlistSize_ = (int)playlist_.size();
+    }
+    requestedTrack_ = start;
   }
 
   void setPlaying(std::string path) {
-    if (player_) {
-      delete player_;
-      player_ = nullptr;
+    if (Playlist::isM3U(path)) {
+      setPlaylist(Playlist::fromM3U(path), 0);
+      return;
     }
-    player_ = CAdPlug::factory(path, &opl_);
-    nextPlayerUpdateIn_ = 0.f;
+    std::vector<std::string> tracks = Playlist::fromDirectory(stringDirectory(path));
+    auto it = std::find(tracks.begin(), tracks.end(), path);
+    if (it == tracks.end()) {
+      it = tracks.insert(tracks.begin(), path);
+    }
+    int start = (int)(it - tracks.begin());
+    setPlaylist(std::move(tracks), start);
+  }
+
+  void runLoader() {
+    while (!stopping_) {
+      for (auto& deck : decks_) {
+	if (deck.state.load(std::memory_order_acquire) != PlayerDeck::LOADING) {
+	  continue;
+	}
+	std::string path;
+	{
+	  std::lock_guard<std::mutex> lock(playlistMutex_);
+	  if (deck.track_ >= 0 && deck.track_ < (int)playlist_.size()) {
+	    path = playlist_[deck.track_];
+	  }
+	}
+	deck.load(path);
+	deck.state.store(PlayerDeck::READY, std::memory_order_release);
+      }
+      // The engine thread doesn't take the lock before notifying, so
+      // a wakeup can be missed. Polling bounds how late it's noticed.
+      std::unique_lock<std::mutex> lock(loaderMutex_);
+      loaderCv_.wait_for(lock, std::chrono::milliseconds(20));
+    }
+  }
+
+  // Hands the standby deck to the loader thread.
+  void loadStandby(int track) {
+    PlayerDeck& standby = decks_[1 - active_];
+    standby.track_ = track;
+    standby.subsong_ = requestedSubsong();
+    standby.state.store(PlayerDeck::LOADING, std::memory_order_release);
+    loaderCv_.notify_one();
+  }
+
+  void switchDecks() {
+    int previous = active_;
+    active_ = 1 - active_;
+    decks_[active_].state = PlayerDeck::PLAYING;
+    std::atomic_store(&displayedSongInfo_, decks_[active_].songInfo_);
+    switchWhenReady_ = false;
+    if (fadeSeconds_ > 0.f && decks_[previous].player_) {
+      fade_ = 0.f;
+    } else if (isPipelined() && decks_[previous].player_) {
+      handoff_ = OPLRenderer::kLatency;
+    } else {
+      fade_ = 1.f;
+      decks_[previous].state = PlayerDeck::EMPTY;
+    }
+  }
+
+  int nextTrack(int offset) {
+    int n = playlistSize_;
+    if (n == 0) {
+      return -1;
+    }
+    return ((decks_[active_].track_ + offset) % n + n) % n;
+  }
+
+  unsigned int requestedSubsong() {
+    int s = (int)round(params[SUBSONG_PARAM].value + inputs[SUBSONG_INPUT].value);
+    return (unsigned int)std::max(s, 0);
   }
 
   void step() override {
-    // Update player if any
-    if (player_) {
-      nextPlayerUpdateIn_ -= engineGetSampleTime();
-      if (nextPlayerUpdateIn_ <= 0.f) {
-	player_->update();
-	float overclockspeed = params[CLOCK_SPEED_PARAM].value + inputs[CLOCK_SPEED_INPUT].value;
-	nextPlayerUpdateIn_ = 1. / (overclockspeed * player_->getrefresh());
+    governor_.beginStep();
+    if (blockStep_ == 0 || governor_.level() < Governor::COARSE_PARAMS) {
+      requestedSubsong_ = requestedSubsong();
+      split_ = false;
+      for (unsigned int c = 0; c < kChipChannels; ++c) {
+	split_ = split_ || outputs[CHANNEL_OUTPUT + c].active;
       }
     }
+    blockStep_ = (blockStep_ + 1) % OPLRenderer::kBlockSize;
 
-    {
-      // Synthesize sound
-      static const int samples = 1;
-      short buf[samples * 2]; // 2 channels
-      opl_.update(buf, samples);
-      outputs[LEFT_OUTPUT].value = (float)buf[0] / (float)0x7fff * 10.f;
-      outputs[RIGHT_OUTPUT].value = (float)buf[1] / (float)0x7fff * 10.f;
+    PlayerDeck* active = &decks_[active_];
+    PlayerDeck* standby = &decks_[1 - active_];
+
+    // Track changes requested from the UI or from trigger inputs
+    int requested = requestedTrack_.exchange(-1);
+    if (requested >= 0) {
+      pendingTrack_ = requested;
+    }
+    if (nextTrigger_.process(inputs[NEXT_INPUT].value)) {
+      if (standby->state == PlayerDeck::READY && standby->track_ == nextTrack(1)) {
+	switchWhenReady_ = true;
+      } else {
+	pendingTrack_ = nextTrack(1);
+      }
+    }
+    if (prevTrigger_.process(inputs[PREV_INPUT].value)) {
+      pendingTrack_ = nextTrack(-1);
+    }
+    if (randomTrigger_.process(inputs[RANDOM_INPUT].value) && playlistSize_ > 0) {
+      pendingTrack_ = (int)(randomUniform() * playlistSize_) % playlistSize_;
+    }
+
+    // Keep the standby deck busy: either with a track we were asked
+    // to jump to, or by prefetching the next track of the playlist.
+    int standbyState = standby->state.load(std::memory_order_acquire);
+    if (!transitioning() && standbyState != PlayerDeck::LOADING) {
+      if (pendingTrack_ >= 0) {
+	loadStandby(pendingTrack_);
+	pendingTrack_ = -1;
+	switchWhenReady_ = true;
+      } else if (standbyState == PlayerDeck::EMPTY && nextTrack(1) >= 0) {
+	loadStandby(nextTrack(1));
+      }
     }
+
+    // Move on to the next track when the current one ends, starting
+    // early enough to fit the crossfade in.
+    float speed = params[CLOCK_SPEED_PARAM].value + inputs[CLOCK_SPEED_INPUT].value;
+    active->selectSubsong(requestedSubsong_);
+    if (active->step(speed)) {
+      endOfTrackPulse_.trigger(1e-3f);
+      switchWhenReady_ = switchWhenReady_ || playlistSize_ > 1;
+    }
+    unsigned long lengthMs = active->lengthMs();
+    float fadeSeconds = params[CROSSFADE_PARAM].value;
+    if (lengthMs > 0 && speed > 0.f) {
+      // Fade over at most half of a short track, or it would switch
+      // as soon as it starts.
+      fadeSeconds = std::min(fadeSeconds, lengthMs / 2000.f / speed);
+    }
+    float crossfadeMs = fadeSeconds * 1000.f * speed;
+    if (lengthMs > 0 && crossfadeMs > 0.f && active->positionMs_ >= lengthMs - crossfadeMs && playlistSize_ > 1) {
+      switchWhenReady_ = true;
+    }
+    if (switchWhenReady_ && !transitioning() && standby->state.load(std::memory_order_acquire) == PlayerDeck::READY) {
+      fadeSeconds_ = fadeSeconds;
+      switchDecks();
+      std::swap(active, standby);
+    }
+
+    outputs[END_OF_TRACK_OUTPUT].value = endOfTrackPulse_.process(engineGetSampleTime()) ? 10.f : 0.f;
+    lengthMs = active->lengthMs();
+    float progress = lengthMs > 0 ? clamp(active->positionMs_ / lengthMs, 0.f, 1.f) : 0.f;
+    outputs[PROGRESS_OUTPUT].value = progress * 10.f;
+
+    // Synthesize sound, unless there's nothing to play and the
+    // governor allows suspending idle instances.
+    if (!active->player_ && !transitioning() && governor_.level() >= Governor::SUSPEND_IDLE) {
+      outputs[LEFT_OUTPUT].value = 0.f;
+      outputs[RIGHT_OUTPUT].value = 0.f;
+      for (unsigned int c = 0; c < kChipChannels; ++c) {
+	outputs[CHANNEL_OUTPUT + c].value = 0.f;
+      }
+      recorder_.write(0, 0);
+      governor_.endStep(OPLRenderer::kBlockSize);
+      return;
+    }
+    bool split = split_;
+    float left, right;
+    float channels[kChipChannels];
+    active->render(&left, &right, split ? channels : nullptr);
+    if (fade_ < 1.f) {
+      float fadingLeft, fadingRight;
+      float fadingChannels[kChipChannels];
+      standby->step(speed);
+      standby->render(&fadingLeft, &fadingRight, split ? fadingChannels : nullptr);
+      left = crossfade(fadingLeft, left, fade_);
+      right = crossfade(fadingRight, right, fade_);
+      if (split) {
+	for (unsigned int c = 0; c < kChipChannels; ++c) {
+	  channels[c] = crossfade(fadingChannels[c], channels[c], fade_);
+	}
+      }
+      fade_ += engineGetSampleTime() / fadeSeconds_;
+      if (fade_ >= 1.f) {
+	fade_ = 1.f;
+	standby->state = PlayerDeck::EMPTY;
+      }
+    } else if (handoff_ > 0) {
+      standby->step(speed);
+      standby->render(&left, &right, split ? channels : nullptr);
+      if (--handoff_ == 0) {
+	standby->state = PlayerDeck::EMPTY;
+      }
+    }
+    outputs[LEFT_OUTPUT].value = left;
+    outputs[RIGHT_OUTPUT].value = right;
+    // Decks render 16-bit samples, which survive the round trip
+    // through float exactly outside of crossfades.
+    recorder_.write((int32_t)lrintf(left / 10.f * (float)0x7fff), (int32_t)lrintf(right / 10.f * (float)0x7fff));
+    if (split) {
+      for (unsigned int c = 0; c < kChipChannels; ++c) {
+	outputs[CHANNEL_OUTPUT + c].value = channels[c];
+      }
+    }
+    governor_.endStep(OPLRenderer::kBlockSize);
   }
 };
 
 static void selectTrackFileAndPlay(Player* module) {
   // Build a filename filter
-  std::string filtersdesc = "All files:*;";
+  std::string filtersdesc = "All files:*;Playlist:m3u,m3u8;";
   for (auto const& r : CAdPlug::players) {
     filtersdesc += r->filetype + ":";
     unsigned int i = 0;
@@ -131,6 +555,7 @@ static void selectTrackFileAndPlay(Player* module) {
   osdialog_filters_free(filters);
   if (path) {
     module->setPlaying(path);
+    free(path);
   }
 }
 
@@ -150,6 +575,25 @@ struct PlayerWidget : ModuleWidget {
 
     addParam(ParamWidget::create<Davies1900hBlackKnob>(Vec(10, 10), module, Player::CLOCK_SPEED_PARAM, 0.0, 16.0, 1.0));
     addInput(Port::create<PJ301MPort>(Vec(10, 40), Port::INPUT, module, Player::CLOCK_SPEED_INPUT));
+
+    auto* subsong = ParamWidget::create<Davies1900hBlackKnob>(Vec(10, 80), module, Player::SUBSONG_PARAM, 0.0, 31.0, 0.0);
+    subsong->snap = true;
+    addParam(subsong);
+    addInput(Port::create<PJ301MPort>(Vec(10, 110), Port::INPUT, module, Player::SUBSONG_INPUT));
+
+    addOutput(Port::create<PJ301MPort>(Vec(10, 250), Port::OUTPUT, module, Player::END_OF_TRACK_OUTPUT));
+    addOutput(Port::create<PJ301MPort>(Vec(40, 250), Port::OUTPUT, module, Player::PROGRESS_OUTPUT));
+
+    // Playlist controls
+    addInput(Port::create<PJ301MPort>(Vec(10, 150), Port::INPUT, module, Player::PREV_INPUT));
+    addInput(Port::create<PJ301MPort>(Vec(40, 150), Port::INPUT, module, Player::NEXT_INPUT));
+    addInput(Port::create<PJ301MPort>(Vec(40, 180), Port::INPUT, module, Player::RANDOM_INPUT));
+    addParam(ParamWidget::create<Davies1900hBlackKnob>(Vec(10, 200), module, Player::CROSSFADE_PARAM, 0.0, 10.0, 0.0));
+
+    // Per-channel outputs
+    for (unsigned int i = 0; i < kChipChannels; ++i) {
+      addOutput(Port::create<PJ301MPort>(Vec(95 + (i % 3) * 28, 40 + (i / 3) * 40), Port::OUTPUT, module, Player::CHANNEL_OUTPUT + i));
+    }
   }
 
   void appendContextMenu(Menu* menu) override {
@@ -166,6 +610,36 @@ struct PlayerWidget : ModuleWidget {
     LoadTrackMenuItem *load = MenuItem::create<LoadTrackMenuItem>("Load track", "");
     load->module = module_;
     menu->addChild(load);
+
+    struct PipelinedMenuItem : MenuItem {
+      Player* module;
+
+      void onAction(EventAction& e) override {
+	module->setPipelined(!module->isPipelined());
+      }
+    };
+
+    PipelinedMenuItem* pipelined = MenuItem::create<PipelinedMenuItem>("Render on background thread", CHECKMARK(module_->isPipelined()));
+    pipelined->module = module_;
+    menu->addChild(pipelined);
+
+    std::shared_ptr<const SongInfo> info = std::atomic_load(&module_->displayedSongInfo_);
+    if (info && info->ready.load(std::memory_order_acquire) && info->valid) {
+      menu->addChild(MenuEntry::create());
+      for (unsigned int i = 0; i < info->subsongs.size(); ++i) {
+	const auto& s = info->subsongs[i];
+	std::string length = stringf("%lu:%02lu", s.lengthMs / 60000, (s.lengthMs / 1000) % 60);
+	if (!s.ends) {
+	  length = "loops";
+	}
+	menu->addChild(MenuLabel::create(stringf("Subsong %u: %s", i, length.c_str())));
+      }
+    } else if (info) {
+      menu->addChild(MenuLabel::create("Measuring track length..."));
+    }
+
+    appendGovernorMenu(menu, &module_->governor_);
+    appendRecorderMenu(menu, &module_->recorder_);
   }
 };
 
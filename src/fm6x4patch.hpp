@@ -0,0 +1,197 @@
+#ifndef FM6X4PATCH_HPP
+#define FM6X4PATCH_HPP
+
+#include <cmath>
+#include <cstdint>
+#include "oplregisters.hpp"
+
+// How FM6x4 turns its parameters and gates into OPL3 register writes.
+// This doesn't depend on Rack, so that the tests can drive the same
+// code as the module.
+//
+// Writes is anything with a push(reg, value) method, such as
+// RegisterWriteList. Source provides the parameter values:
+//   float paramValue(int param): the knob position, from 0 to 10.
+//   float paramModulation(int param, float maxvalue, unsigned int channel):
+//     what learned CV inputs add to it for a given channel.
+struct FM6x4Patch {
+  enum PatchParamIds {
+    ALGORITHM_PARAM,
+    TREMOLO_PARAM,
+    VIBRATO_PARAM = TREMOLO_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    SUSTAIN_TOGGLE_PARAM = VIBRATO_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    KSR_PARAM = SUSTAIN_TOGGLE_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    MULTI_PARAM = KSR_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    KSL_PARAM = MULTI_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    ATTENUATION_PARAM = KSL_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    WAVEFORM_PARAM = ATTENUATION_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    ATTACK_PARAM = WAVEFORM_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    DECAY_PARAM = ATTACK_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    SUSTAIN_PARAM = DECAY_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+    RELEASE_PARAM = SUSTAIN_PARAM + OPL3::FourOP::kOperatorsPerChannel,
+
+    NUM_SAVEABLE_PARAMS = RELEASE_PARAM + OPL3::FourOP::kOperatorsPerChannel
+  };
+
+  template<typename Writes>
+  static void programInitialRegisters(Writes& writes) {
+    // Init code
+    for (unsigned int i = 0x00; i < 0x300; ++i) {
+      writes.push(i, 0x00);
+    }
+    writes.push(0x01, 1<<5); // Enable waveform selection per operator
+    writes.push(0x105, 0x01); // Enable OPL3 features
+    writes.push(0x104, 0xff); // Enable 4-OP for all 6 channels
+  }
+
+  template<typename Source>
+  static uint8_t getScaledParam(const Source& source, int param, float maxvalue, uint8_t mask, unsigned int channel) {
+    float value = source.paramModulation(param, maxvalue, channel);
+    value += source.paramValue(param);
+    value = fminf(fmaxf(value, 0.f), 10.f);
+    value /= maxvalue;
+    if (value < 0.f) {
+      return (uint8_t)(0);
+    }
+    return static_cast<uint8_t>(round((float)mask * value));
+  }
+
+  // Writes the registers computed from one group of parameters, 1 to
+  // 6. FM6x4 spreads the groups over the first steps of each block.
+  template<typename Source, typename Writes>
+  static void writeRegisterGroup(unsigned int group, const Source& source, Writes& writes) {
+    //// Configure the chip
+    // 21	Operator 1	Tremolo/Vibrato/Sustain/KSR/Multiplication
+    // 24	Operator 2	Tremolo/Vibrato/Sustain/KSR/Multiplication
+    // 29	Operator 3	Tremolo/Vibrato/Sustain/KSR/Multiplication
+    // 2C	Operator 4	Tremolo/Vibrato/Sustain/KSR/Multiplication
+    if (group == 1) {
+      for (unsigned int op = 0; op < 4; ++op) {
+	for (unsigned int ch = 0; ch < 6; ++ch) {
+	  OPL3::OperatorConfigEffects o{
+	  tremolo: getScaledParam(source, TREMOLO_PARAM + op, 1.0, 0x1, ch),
+	      vibrato: getScaledParam(source, VIBRATO_PARAM + op, 1.0, 0x1, ch),
+	      sustain: getScaledParam(source, SUSTAIN_TOGGLE_PARAM + op, 1.0, 0x1, ch),
+	      ksr: getScaledParam(source, KSR_PARAM + op, 1.0, 0x1, ch),
+	      multi: getScaledParam(source, MULTI_PARAM + op, 15.0, 0xf, ch),
+	      };
+	  writes.push(OPL3::OperatorRegister(0x20, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
+	}
+      }
+    }
+
+    // 41	Operator 1	Key Scale Level/Output Level
+    // 44	Operator 2	Key Scale Level/Output Level
+    // 49	Operator 3	Key Scale Level/Output Level
+    // 4C	Operator 4	Key Scale Level/Output Level
+    if (group == 2) {
+      for (unsigned int op = 0; op < 4; ++op) {
+	for (unsigned int ch = 0; ch < 6; ++ch) {
+	  OPL3::OperatorConfigLevels o{
+	  ksl: getScaledParam(source, KSL_PARAM + op, 1.0, 0x1, ch),
+	      level: getScaledParam(source, ATTENUATION_PARAM + op, 1.0, 0x1, ch),
+	      };
+	  writes.push(OPL3::OperatorRegister(0x40, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
+	}
+      }
+    }
+
+    // 61	Operator 1	Attack Rate/Decay Rate
+    // 64	Operator 2	Attack Rate/Decay Rate
+    // 69	Operator 3	Attack Rate/Decay Rate
+    // 6C	Operator 4	Attack Rate/Decay Rate
+    if (group == 3) {
+      for (unsigned int op = 0; op < 4; ++op) {
+	for (unsigned int ch = 0; ch < 6; ++ch) {
+	  OPL3::OperatorConfigAtkDec o{
+	  attack: getScaledParam(source, ATTACK_PARAM + op, 15.0, 0xf, ch),
+	      decay: getScaledParam(source, DECAY_PARAM + op, 15.0, 0xf, ch),
+	      };
+	  writes.push(OPL3::OperatorRegister(0x60, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
+	}
+      }
+    }
+
+    // 81	Operator 1	Sustain Level/Release Rate
+    // 84	Operator 2	Sustain Level/Release Rate
+    // 89	Operator 3	Sustain Level/Release Rate
+    // 8C	Operator 4	Sustain Level/Release Rate
+    if (group == 4) {
+      for (unsigned int op = 0; op < 4; ++op) {
+	for (unsigned int ch = 0; ch < 6; ++ch) {
+	  OPL3::OperatorConfigSusRel o{
+	  sustain: getScaledParam(source, SUSTAIN_PARAM + op, 15.0, 0xf, ch),
+	      release: getScaledParam(source, RELEASE_PARAM + op, 15.0, 0xf, ch),
+	      };
+	  writes.push(OPL3::OperatorRegister(0x80, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
+	}
+      }
+    }
+
+    // C1		FeedBack/Synthesis Type (part 1)
+    // C4		Synthesis Type (part 2)
+    if (group == 5) {
+      unsigned int algorithm = static_cast<unsigned int>(fminf(fmaxf(source.paramValue(ALGORITHM_PARAM), 0.0f), 4.0f));
+      uint8_t feedback = 0x00; // TODO: implement feedback. Only affects operator 1 of each algorithm, ignored for other operators.
+
+      OPL3::ChannelConfigSynthesis c_primary{
+      outch_d: false,  // We don't use the extra channels C and D
+	  outch_c: false,
+	  outch_r: true, // TODO?
+	  outch_l: true,
+	  feedback: feedback, // TODO!
+	  synthtype: (uint8_t)(algorithm & 1), // safe cast: x&1 fits on 1 bit
+	  };
+      OPL3::ChannelConfigSynthesis c_secondary{
+      outch_d: false,
+	  outch_c: false,
+	  outch_r: false, // L, R and feedback are ignored for secondary channel config
+	  outch_l: false,
+	  feedback: 0,
+	  synthtype: (uint8_t)((algorithm & 2) >> 1), // safe cast: ((x>>2)&1) fits on 1 bit
+	  };
+      for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+	writes.push(OPL3::ChannelRegister(0xC0, OPL3::FourOP::kHWChannels[ch]), c_primary.value()); // Set synthesis type & feedback for channel 0
+	writes.push(OPL3::ChannelRegister(0xC0, OPL3::FourOP::kHWChannels[ch] + 3), c_secondary.value()); // Same for shadow channel 3
+      }
+    }
+
+    // E1	Operator 1	Waveform Select
+    // E4	Operator 2	Waveform Select
+    // E9	Operator 3	Waveform Select
+    // EC	Operator 4	Waveform Select
+    if (group == 6) {
+      for (unsigned int op = 0; op < 4; ++op) {
+	for (unsigned int ch = 0; ch < 6; ++ch) {
+	  OPL3::OperatorConfigWaveform o{
+	  waveform: getScaledParam(source, WAVEFORM_PARAM + op, 7.0f, 0x7, ch),
+	      };
+	  writes.push(OPL3::OperatorRegister(0xE0, OPL3::FourOP::kHWOperatorForChannel[ch] + 3*op), o.value());
+	}
+      }
+    }
+  }
+
+  // Writes the note of a channel whose gate just changed.
+  // A1		Frequency Number (low)
+  // A4		Unused
+  // B1		Key On/Block Number/Frequency Number (high)
+  // B4		Unused
+  template<typename Writes>
+  static void writeNote(unsigned int ch, bool gate, float cv, Writes& writes) {
+    OPL3::Note n{};
+    bool send_keyon = gate && n.computeOPLParamsFromCV(cv);
+    OPL3::ChannelConfigNote o{};
+    o.A.freqlow8bits = n.freqLo;
+    o.B.keyon = send_keyon;
+    o.B.block = n.block;
+    o.B.freqhi2bits = n.freqHi;
+
+    writes.push(OPL3::ChannelRegister(0xA0, OPL3::FourOP::kHWChannels[ch]), o.A.value());
+    writes.push(OPL3::ChannelRegister(0xA0, OPL3::FourOP::kHWChannels[ch] + 3), o.A.value());
+    writes.push(OPL3::ChannelRegister(0xB0, OPL3::FourOP::kHWChannels[ch]), o.B.value());
+    writes.push(OPL3::ChannelRegister(0xB0, OPL3::FourOP::kHWChannels[ch] + 3), o.B.value());
+  }
+};
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef OPLREGISTERS_HPP
 #define OPLREGISTERS_HPP
 
+#include <cmath>
+#include <cstdint>
+
 namespace OPL3 {
 
   // This file contains POD-style classes that allows one to populate
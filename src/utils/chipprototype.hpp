@@ -0,0 +1,37 @@
+#ifndef CHIPPROTOTYPE_HPP
+#define CHIPPROTOTYPE_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// DBOPL must be included before this file.
+
+// Initializing a chip and programming its initial registers one write
+// at a time is slow enough to be noticed when a patch with many
+// instances is loaded. Instead, each initial state is built once per
+// process and sample rate, and instances start from a copy of it.
+struct ChipPrototypes {
+  // Writes the initial registers of a given layout.
+  typedef void (*Program)(DBOPL::Handler& opl);
+
+  // The returned chip lives as long as the process. Takes a lock, so
+  // it should be called when the module is created rather than from
+  // the engine thread.
+  static const DBOPL::Handler& get(unsigned int rate, Program program) {
+    static std::mutex mutex;
+    static std::map<std::pair<unsigned int, Program>, std::unique_ptr<DBOPL::Handler>> prototypes;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<DBOPL::Handler>& prototype = prototypes[std::make_pair(rate, program)];
+    if (!prototype) {
+      prototype.reset(new DBOPL::Handler());
+      prototype->Init(rate);
+      program(*prototype);
+    }
+    return *prototype;
+  }
+};
+
+#endif
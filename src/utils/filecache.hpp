@@ -0,0 +1,190 @@
+#ifndef FILECACHE_HPP
+#define FILECACHE_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef ARCH_WIN
+// Keeps windows.h from defining min() and max() macros, which break
+// std::min and std::max in every file included after this one.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "binstr.h"
+
+// AdPlug must be included before this file.
+
+// A read-only memory mapping of a whole file.
+struct MappedFile {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+
+  explicit MappedFile(const std::string& path) {
+#ifdef ARCH_WIN
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+      return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+      return;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) {
+      return;
+    }
+    data = (const uint8_t*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (data) {
+      this->size = (size_t)size.QuadPart;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+	data = (const uint8_t*)p;
+	size = (size_t)st.st_size;
+      }
+    }
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#ifdef ARCH_WIN
+    if (data) {
+      UnmapViewOfFile(data);
+    }
+    if (mapping_) {
+      CloseHandle(mapping_);
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+      CloseHandle(file_);
+    }
+#else
+    if (data) {
+      munmap((void*)data, size);
+    }
+#endif
+  }
+
+  bool valid() const {
+    return data != nullptr;
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+#ifdef ARCH_WIN
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#endif
+};
+
+// Process-wide cache of file mappings. Everyone opening the same path
+// gets the same mapping, which is released when the last user drops
+// it.
+struct FileCache {
+  // Returns nullptr if the file can't be mapped (missing, empty...).
+  static std::shared_ptr<const MappedFile> acquire(const std::string& path) {
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const MappedFile>> files;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<const MappedFile> file = files[path].lock();
+    if (!file) {
+      auto mapped = std::make_shared<MappedFile>(path);
+      if (!mapped->valid()) {
+	files.erase(path);
+	return nullptr;
+      }
+      file = mapped;
+      files[path] = file;
+    }
+    // Drop entries for files nobody uses anymore.
+    for (auto it = files.begin(); it != files.end(); ) {
+      it = it->second.expired() ? files.erase(it) : std::next(it);
+    }
+    return file;
+  }
+};
+
+// An AdPlug file provider that reads from FileCache mappings instead
+// of opening the file again for each format a player tries. Every file
+// opened through it stays mapped as long as the provider exists.
+struct CProvider_Mapped : CFileProvider {
+  virtual binistream* open(std::string filename) const override {
+    std::shared_ptr<const MappedFile> file = FileCache::acquire(filename);
+    if (!file) {
+      return nullptr;
+    }
+    files_[filename] = file;
+    binisstream* f = new binisstream((void*)file->data, file->size);
+    // Same flags as CProvider_Filesystem
+    f->setFlag(binio::BigEndian, false);
+    f->setFlag(binio::FloatIEEE);
+    return f;
+  }
+
+  virtual void close(binistream* f) const override {
+    delete f;
+  }
+
+private:
+  // open() is const in the CFileProvider interface. Keyed by path,
+  // since players open the same file once per format they try.
+  mutable std::map<std::string, std::shared_ptr<const MappedFile>> files_;
+};
+
+// Like CAdPlug::factory(), but only tries the players that don't match
+// the file extension once those that do have failed, instead of trying
+// them all a second time.
+static CPlayer* loadTrack(const std::string& path, Copl* opl, const CFileProvider& fp) {
+  std::vector<const CPlayerDesc*> others;
+  for (const CPlayerDesc* desc : CAdPlug::players) {
+    bool matches = false;
+    unsigned int i = 0;
+    const char* ext;
+    while (!matches && (ext = desc->get_extension(i++))) {
+      matches = CFileProvider::extension(path, ext);
+    }
+    if (!matches) {
+      others.push_back(desc);
+      continue;
+    }
+    CPlayer* p = desc->factory(opl);
+    if (p && p->load(path, fp)) {
+      return p;
+    }
+    delete p;
+  }
+  for (const CPlayerDesc* desc : others) {
+    CPlayer* p = desc->factory(opl);
+    if (p && p->load(path, fp)) {
+      return p;
+    }
+    delete p;
+  }
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef GOVERNOR_HPP
+#define GOVERNOR_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// rack.hpp must be included before this file.
+
+// Process-wide CPU budget governor for OPL33t instances.
+//
+// Each instance measures how long its step() takes over a sampled
+// block and reports it as a fraction of the real-time budget for that
+// block. When all instances together use more than kHighLoad of the
+// engine thread, the governor degrades the most expensive instance by
+// one quality level; when they use less than kLowLoad, it restores the
+// most degraded one, unless what it cost at the higher level would put
+// the total back over kHighLoad. At most one change is made per
+// kUpdatePeriodMs so the effect of each change can be measured before
+// the next.
+//
+// Other modules can overload the engine while OPL33t's share stays
+// low. The governor also counts how many samples the instances step
+// per second: when the engine keeps up with less than kOverloaded of
+// the sample rate, it degrades as if the load were high, and it
+// restores nothing until the engine has kept up for kRecoveryMs.
+struct Governor {
+  enum Level {
+    FULL,
+    // Parameters are turned into register writes less often.
+    COARSE_PARAMS,
+    // Instances that are silent and not being played stop rendering.
+    SUSPEND_IDLE,
+    NUM_LEVELS
+  };
+
+  static const char* levelName(int level) {
+    switch (level) {
+    case FULL: return "Full";
+    case COARSE_PARAMS: return "Coarse parameters";
+    case SUSPEND_IDLE: return "Suspend when idle";
+    default: return "";
+    }
+  }
+
+  struct Slot {
+    std::atomic<bool> used{false};
+    std::atomic<float> load{0.f};
+    std::atomic<int> level{FULL};
+    // Level the user locked this instance to, -1 if automatic.
+    std::atomic<int> locked{-1};
+    // Steps taken since acquire(), counted a block at a time.
+    std::atomic<uint32_t> steps{0};
+    // Last load measured at each level, and steps at the last update,
+    // only used by update().
+    float loadAtLevel[NUM_LEVELS] = {};
+    uint32_t stepsAtUpdate = 0;
+    bool counted = false;
+  };
+
+  static const unsigned int kMaxSlots = 256;
+  static constexpr float kHighLoad = 0.5f;
+  static constexpr float kLowLoad = 0.3f;
+  static const int64_t kUpdatePeriodMs = 250;
+  static constexpr float kOverloaded = 0.95f;
+  static const int64_t kRecoveryMs = 5000;
+
+  static Governor& get() {
+    static Governor governor;
+    return governor;
+  }
+
+  // Returns nullptr if all slots are taken, in which case the instance
+  // just runs at full quality.
+  Slot* acquire() {
+    for (auto& slot : slots_) {
+      bool expected = false;
+      if (slot.used.compare_exchange_strong(expected, true)) {
+	slot.load = 0.f;
+	slot.level = FULL;
+	slot.locked = -1;
+	slot.steps = 0;
+	for (float& load : slot.loadAtLevel) {
+	  load = 0.f;
+	}
+	slot.counted = false;
+	return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  void release(Slot* slot) {
+    if (slot) {
+      slot->used = false;
+    }
+  }
+
+  // Called by instances after reporting a measurement. Only does work
+  // once per kUpdatePeriodMs, on whichever thread gets there first.
+  void update() {
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t last = lastUpdate_.load(std::memory_order_relaxed);
+    if (now - last < kUpdatePeriodMs || !lastUpdate_.compare_exchange_strong(last, now)) {
+      return;
+    }
+
+    float total = 0.f;
+    // Every instance steps once per engine sample, so the one that
+    // stepped the most since the last update tells how far the engine
+    // got.
+    uint32_t stepped = 0;
+    Slot* mostExpensive = nullptr;
+    Slot* mostDegraded = nullptr;
+    for (auto& slot : slots_) {
+      if (!slot.used) {
+	continue;
+      }
+      uint32_t steps = slot.steps.load(std::memory_order_relaxed);
+      if (slot.counted) {
+	stepped = std::max(stepped, steps - slot.stepsAtUpdate);
+      }
+      slot.stepsAtUpdate = steps;
+      slot.counted = true;
+      float load = slot.load.load(std::memory_order_relaxed);
+      total += load;
+      int level = slot.level.load(std::memory_order_relaxed);
+      slot.loadAtLevel[level] = load;
+      int locked = slot.locked.load(std::memory_order_relaxed);
+      if (locked >= 0) {
+	slot.level = locked;
+	continue;
+      }
+      if (level < NUM_LEVELS - 1 && (!mostExpensive || load > mostExpensive->load)) {
+	mostExpensive = &slot;
+      }
+      if (level > FULL && (!mostDegraded || level > mostDegraded->level)) {
+	mostDegraded = &slot;
+      }
+    }
+
+    // Audio drivers run the engine in bursts, so the throughput is
+    // smoothed over about ten updates. Gaps between updates that are
+    // too long, such as while the engine is paused, aren't measured.
+    if (now - last < 2 * kUpdatePeriodMs && stepped > 0) {
+      float throughput = stepped / ((now - last) / 1000.f * engineGetSampleRate());
+      throughput_ = throughput_ * 0.9f + throughput * 0.1f;
+    }
+    bool overloaded = throughput_ < kOverloaded;
+    if (overloaded) {
+      lastOverload_ = now;
+    }
+
+    if ((total > kHighLoad || overloaded) && mostExpensive) {
+      mostExpensive->level++;
+    } else if (total < kLowLoad && now - lastOverload_ >= kRecoveryMs && mostDegraded) {
+      int level = mostDegraded->level;
+      if (total - mostDegraded->load + mostDegraded->loadAtLevel[level - 1] < kHighLoad) {
+	mostDegraded->level = level - 1;
+      }
+    }
+  }
+
+private:
+  Slot slots_[kMaxSlots];
+  std::atomic<int64_t> lastUpdate_{0};
+  // Samples stepped per sample of real time, only used by update().
+  float throughput_ = 1.f;
+  int64_t lastOverload_ = 0;
+};
+
+// An instance's handle on the governor. Measures one block out of
+// kMeasureEvery, so that reading the clock stays cheap.
+struct GovernedInstance {
+  static const unsigned int kMeasureEvery = 16;
+
+  GovernedInstance() : slot_(Governor::get().acquire()) {}
+
+  ~GovernedInstance() {
+    Governor::get().release(slot_);
+  }
+
+  int level() const {
+    return slot_ ? slot_->level.load(std::memory_order_relaxed) : Governor::FULL;
+  }
+
+  // -1 for automatic.
+  int lockedLevel() const {
+    return slot_ ? slot_->locked.load(std::memory_order_relaxed) : -1;
+  }
+
+  void lock(int level) {
+    if (slot_) {
+      slot_->locked = level;
+      if (level >= 0) {
+	slot_->level = level;
+      }
+    }
+  }
+
+  // Wrap each step() between these. blockSize is the number of steps
+  // measured at once.
+  void beginStep() {
+    if (measuring_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  void endStep(unsigned int blockSize) {
+    if (measuring_) {
+      elapsed_ += std::chrono::steady_clock::now() - start_;
+    }
+    if (++steps_ < blockSize) {
+      return;
+    }
+    steps_ = 0;
+    if (slot_) {
+      slot_->steps.fetch_add(blockSize, std::memory_order_relaxed);
+    }
+    if (measuring_ && slot_) {
+      float budget = blockSize * engineGetSampleTime();
+      float load = std::chrono::duration<float>(elapsed_).count() / budget;
+      // Smooth out scheduling noise.
+      float smoothed = slot_->load.load(std::memory_order_relaxed) * 0.8f + load * 0.2f;
+      slot_->load.store(smoothed, std::memory_order_relaxed);
+      Governor::get().update();
+    }
+    elapsed_ = std::chrono::steady_clock::duration::zero();
+    measuring_ = (++blocks_ % kMeasureEvery) == 0;
+  }
+
+private:
+  Governor::Slot* slot_;
+  bool measuring_ = false;
+  unsigned int steps_ = 0;
+  unsigned int blocks_ = 0;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::duration elapsed_ = std::chrono::steady_clock::duration::zero();
+};
+
+// Shows the current quality level of an instance in its context menu,
+// and lets the user lock it.
+static void appendGovernorMenu(Menu* menu, GovernedInstance* governor) {
+  menu->addChild(MenuEntry::create());
+  menu->addChild(MenuLabel::create(stringf("Quality: %s", Governor::levelName(governor->level()))));
+
+  struct QualityMenuItem : MenuItem {
+    GovernedInstance* governor;
+    int level;
+
+    void onAction(EventAction& e) override {
+      governor->lock(level);
+    }
+  };
+
+  for (int level = -1; level < Governor::NUM_LEVELS; ++level) {
+    std::string text = level < 0 ? "Automatic" : stringf("Lock to %s", Governor::levelName(level));
+    QualityMenuItem* item = MenuItem::create<QualityMenuItem>(text, CHECKMARK(governor->lockedLevel() == level));
+    item->governor = governor;
+    item->level = level;
+    menu->addChild(item);
+  }
+}
+
+#endif
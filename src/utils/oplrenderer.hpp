@@ -0,0 +1,457 @@
+#ifndef OPLRENDERER_HPP
+#define OPLRENDERER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "spscring.hpp"
+
+// DBOPL must be included before this file.
+
+static const unsigned int kChipChannels = 18;
+// Number of samples rendered at once in pipelined mode.
+static const unsigned int kRenderBlockSize = 32;
+
+// Renders interleaved stereo samples whatever the chip mode, like
+// DBOPL::Handler::Generate: in OPL2 mode (0x105 bit 0 clear) the chip
+// only renders the first register set, in mono, and each sample goes
+// to both sides.
+static void GenerateBlockStereo(DBOPL::Chip& chip, unsigned int total, int32_t* output) {
+  if (chip.opl3Active) {
+    chip.GenerateBlock3(total, output);
+    return;
+  }
+  chip.GenerateBlock2(total, output);
+  for (unsigned int i = total; i-- > 0; ) {
+    output[i * 2] = output[i * 2 + 1] = output[i];
+  }
+}
+
+// Same as GenerateBlockStereo, but also keeps the output of each
+// channel in its own mono buffer. channels points to kChipChannels
+// buffers of stride samples each, one per register channel (0-8 for
+// the first register set, 9-17 for the second). 4-op channels are
+// rendered in the first channel of their pair, and percussion mode
+// channels are all rendered in channel 6. At most kRenderBlockSize
+// samples can be generated per call.
+static void GenerateBlock3Split(DBOPL::Chip& chip, unsigned int total, int32_t* output, int32_t* channels, unsigned int stride) {
+  // DBOPL stores channels so that 4-op pairs are adjacent.
+  static const unsigned int kRegisterChannel[kChipChannels] = {0, 3, 1, 4, 2, 5, 6, 7, 8, 9, 12, 10, 13, 11, 14, 15, 16, 17};
+  int32_t tmp[kRenderBlockSize * 2];
+  // In OPL2 mode, channels render mono samples, and only those of the
+  // first register set are rendered.
+  bool opl3 = chip.opl3Active;
+  DBOPL::Channel* end = chip.chan + (opl3 ? kChipChannels : kChipChannels / 2);
+  while (total > 0) {
+    unsigned int samples = chip.ForwardLFO(total);
+    memset(output, 0, sizeof(int32_t) * samples * 2);
+    for (unsigned int c = 0; c < kChipChannels; ++c) {
+      memset(channels + c * stride, 0, sizeof(int32_t) * samples);
+    }
+    for (DBOPL::Channel* ch = chip.chan; ch < end; ) {
+      int32_t* dst = channels + kRegisterChannel[ch - chip.chan] * stride;
+      memset(tmp, 0, sizeof(int32_t) * samples * 2);
+      ch = (ch->*(ch->synthHandler))(&chip, samples, tmp);
+      for (unsigned int i = 0; i < samples; ++i) {
+	int32_t left = opl3 ? tmp[i * 2] : tmp[i];
+	int32_t right = opl3 ? tmp[i * 2 + 1] : tmp[i];
+	output[i * 2] += left;
+	output[i * 2 + 1] += right;
+	// A channel plays the same sample on every side it's enabled on.
+	dst[i] = left ? left : right;
+      }
+    }
+    total -= samples;
+    output += samples * 2;
+    channels += samples;
+  }
+}
+
+// Everything needed to render one chip on the render worker: the
+// chip itself, the register writes submitted by the engine thread
+// for each block, and the finished blocks of samples.
+struct OPLRenderJob {
+  static const unsigned int kBlockSize = kRenderBlockSize;
+  static const unsigned int kMaxWritesPerBlock = 1024;
+  // Pseudo-register that resets the chip instead of writing to it.
+  static const uint16_t kResetChip = 0xffff;
+
+  struct WriteBlock {
+    uint16_t regs[kMaxWritesPerBlock];
+    uint8_t values[kMaxWritesPerBlock];
+    // Sample within the block before which the write happens.
+    uint8_t offsets[kMaxWritesPerBlock];
+    unsigned int size = 0;
+    unsigned int rate = 0;
+    // Whether per-channel outputs should be rendered too.
+    bool split = false;
+
+    void push(unsigned int reg, uint8_t value, unsigned int offset) {
+      if (size < kMaxWritesPerBlock) {
+	regs[size] = (uint16_t)reg;
+	values[size] = value;
+	offsets[size] = (uint8_t)offset;
+	size++;
+      }
+    }
+  };
+
+  struct SampleBlock {
+    int32_t samples[kBlockSize * 2];
+    int32_t channels[kChipChannels][kBlockSize];
+    bool split;
+  };
+
+  // Only touched by whoever holds busy.
+  DBOPL::Handler chip;
+  SpscRing<WriteBlock, 4> writes;
+  SpscRing<SampleBlock, 4> samples;
+  std::atomic<bool> busy{false};
+
+  void lock() {
+    while (busy.exchange(true, std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+
+  void unlock() {
+    busy.store(false, std::memory_order_release);
+  }
+
+  static void apply(DBOPL::Handler& chip, uint16_t reg, uint8_t value, unsigned int rate) {
+    if (reg == kResetChip) {
+      chip.Init(rate);
+    } else {
+      chip.WriteReg(reg, value);
+    }
+  }
+
+  // Renders every submitted block there is room for. Called by the
+  // render worker, and by the engine thread when the worker falls
+  // behind. Returns false if another thread was already rendering.
+  bool renderPending() {
+    if (busy.exchange(true, std::memory_order_acquire)) {
+      return false;
+    }
+    WriteBlock* in;
+    SampleBlock* out;
+    while ((in = writes.front()) && (out = samples.back())) {
+      unsigned int pos = 0;
+      unsigned int i = 0;
+      while (pos < kBlockSize) {
+	for (; i < in->size && in->offsets[i] <= pos; ++i) {
+	  apply(chip, in->regs[i], in->values[i], in->rate);
+	}
+	unsigned int next = i < in->size ? in->offsets[i] : kBlockSize;
+	if (in->split) {
+	  GenerateBlock3Split(chip.chip, next - pos, out->samples + pos * 2, &out->channels[0][pos], kBlockSize);
+	} else {
+	  GenerateBlockStereo(chip.chip, next - pos, out->samples + pos * 2);
+	}
+	pos = next;
+      }
+      out->split = in->split;
+      writes.pop();
+      samples.push();
+    }
+    unlock();
+    return true;
+  }
+};
+
+// A small pool of threads shared by all OPL33t instances that render
+// their chip in pipelined mode.
+struct RenderWorker {
+  static RenderWorker& get() {
+    static RenderWorker worker;
+    return worker;
+  }
+
+  void add(std::shared_ptr<OPLRenderJob> job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(job);
+    generation_++;
+  }
+
+  void remove(const std::shared_ptr<OPLRenderJob>& job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.erase(std::remove(jobs_.begin(), jobs_.end(), job), jobs_.end());
+    generation_++;
+  }
+
+  // Called by the engine thread after submitting a block.
+  void wake() {
+    if (sleeping_.load() > 0) {
+      cv_.notify_one();
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::shared_ptr<OPLRenderJob>> jobs_;
+  std::atomic<unsigned int> generation_{0};
+  std::atomic<int> sleeping_{0};
+  std::atomic<bool> stopping_{false};
+  std::vector<std::thread> threads_;
+
+  RenderWorker() {
+    unsigned int n = std::min(2u, std::max(1u, std::thread::hardware_concurrency() - 1));
+    for (unsigned int i = 0; i < n; ++i) {
+      threads_.emplace_back(&RenderWorker::run, this);
+    }
+  }
+
+  ~RenderWorker() {
+    stopping_ = true;
+    cv_.notify_all();
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+  void run() {
+    // Each thread works on its own copy of the job list, so that
+    // jobs can be added and removed without stopping the workers.
+    // Removed jobs stay alive until every copy is refreshed.
+    std::vector<std::shared_ptr<OPLRenderJob>> jobs;
+    unsigned int generation = ~0u;
+    while (!stopping_) {
+      if (generation != generation_.load()) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	jobs = jobs_;
+	generation = generation_.load();
+      }
+      bool worked = false;
+      for (auto& job : jobs) {
+	if (!job->writes.empty()) {
+	  worked = job->renderPending() || worked;
+	}
+      }
+      if (!worked) {
+	// Notifications are sent without the lock held and may be
+	// missed, the timeout bounds how late such a block is picked up.
+	std::unique_lock<std::mutex> lock(mutex_);
+	sleeping_++;
+	cv_.wait_for(lock, std::chrono::microseconds(500));
+	sleeping_--;
+      }
+    }
+  }
+};
+
+// An OPL3 chip that is rendered either inline, one sample at a time
+// on the engine thread, or in pipelined mode, where the render worker
+// renders whole blocks ahead of the engine thread. Pipelined mode adds
+// kLatency samples (two blocks) of latency: block N's writes are
+// submitted at the end of block N, and block N is only played back
+// during block N + 2, which gives the worker a whole block to render
+// it. With only one block of latency the engine thread would need
+// block N as soon as it was submitted and would end up rendering it
+// itself or waiting for the worker. Its method names follow
+// DBOPL::Handler so that it can be used in its place.
+struct OPLRenderer {
+  static const unsigned int kBlockSize = OPLRenderJob::kBlockSize;
+  static const unsigned int kPrimedBlocks = 2;
+  static const unsigned int kLatency = kPrimedBlocks * kBlockSize;
+
+  explicit OPLRenderer(unsigned int rate) : rate_(rate) {
+    chip_.Init(rate_);
+  }
+
+  // Starts from a copy of an initialized chip, see ChipPrototypes.
+  OPLRenderer(const DBOPL::Handler& initial, unsigned int rate) : chip_(initial), rate_(rate) {}
+
+  ~OPLRenderer() {
+    if (job_) {
+      RenderWorker::get().remove(job_);
+    }
+  }
+
+  // Called from the UI thread. The change takes effect at the next
+  // block boundary.
+  void setPipelined(bool pipelined) {
+    if (pipelined && !jobReady_) {
+      job_ = std::make_shared<OPLRenderJob>();
+      RenderWorker::get().add(job_);
+      jobReady_.store(true, std::memory_order_release);
+    }
+    pipelinedRequested_ = pipelined;
+  }
+
+  bool isPipelinedRequested() const {
+    return pipelinedRequested_;
+  }
+
+  // The methods below are called by whichever thread currently owns
+  // the module's chip, normally the engine thread.
+
+  void Init(unsigned int rate) {
+    rate_ = rate;
+    if (pipelined_) {
+      pending_.push(OPLRenderJob::kResetChip, 0, offset_);
+    } else {
+      chip_.Init(rate_);
+    }
+  }
+
+  void WriteReg(unsigned int reg, uint8_t value) {
+    if (pipelined_) {
+      pending_.push(reg, value, offset_);
+    } else {
+      chip_.WriteReg(reg, value);
+    }
+  }
+
+  // Produces one stereo sample. If channels isn't null, it also
+  // receives the mono output of each of the kChipChannels channels
+  // (see GenerateBlock3Split), at a small extra cost.
+  void generate(int32_t* out, int32_t* channels = nullptr) {
+    if (offset_ == 0) {
+      updateMode();
+    }
+    if (pipelined_) {
+      out[0] = current_->samples[offset_ * 2];
+      out[1] = current_->samples[offset_ * 2 + 1];
+      if (channels) {
+	// Channels requested for the first time come out of the first
+	// block rendered split, kLatency samples later.
+	pending_.split = true;
+	for (unsigned int c = 0; c < kChipChannels; ++c) {
+	  channels[c] = current_->split ? current_->channels[c][offset_] : 0;
+	}
+      }
+    } else if (channels) {
+      GenerateBlock3Split(chip_.chip, 1, out, channels, 1);
+    } else {
+      GenerateBlockStereo(chip_.chip, 1, out);
+    }
+    if (++offset_ == kBlockSize) {
+      offset_ = 0;
+      if (pipelined_) {
+	submit();
+      }
+    }
+  }
+
+  // Replaces the whole chip state with a copy of another chip,
+  // initialized at the given rate. In pipelined mode this drops
+  // everything in flight, like restart().
+  void loadState(const DBOPL::Handler& state, unsigned int rate) {
+    rate_ = rate;
+    if (!pipelined_) {
+      chip_ = state;
+      return;
+    }
+    restart();
+    job_->lock();
+    job_->chip = state;
+    job_->unlock();
+  }
+
+  // Drops everything in flight and starts again from silence, for
+  // when the chip is about to be reprogrammed from scratch.
+  void restart() {
+    if (!pipelined_) {
+      return;
+    }
+    job_->lock();
+    job_->writes.clear();
+    job_->samples.clear();
+    primeSilence();
+    job_->unlock();
+    pending_.size = 0;
+    offset_ = 0;
+  }
+
+private:
+  DBOPL::Handler chip_; // Only used when not pipelined
+  unsigned int rate_;
+  std::shared_ptr<OPLRenderJob> job_;
+  std::atomic<bool> jobReady_{false};
+  std::atomic<bool> pipelinedRequested_{false};
+  bool pipelined_ = false;
+  unsigned int offset_ = 0;
+  OPLRenderJob::WriteBlock pending_;
+  OPLRenderJob::SampleBlock* current_ = nullptr;
+
+  // Must hold the job lock.
+  void primeSilence() {
+    for (unsigned int i = 0; i < kPrimedBlocks; ++i) {
+      OPLRenderJob::SampleBlock* silence = job_->samples.back();
+      memset(silence->samples, 0, sizeof(silence->samples));
+      silence->split = false;
+      job_->samples.push();
+    }
+    current_ = job_->samples.front();
+  }
+
+  void updateMode() {
+    bool requested = pipelinedRequested_.load(std::memory_order_relaxed);
+    if (requested == pipelined_ || !jobReady_.load(std::memory_order_acquire)) {
+      return;
+    }
+    job_->lock();
+    if (requested) {
+      job_->chip = chip_;
+      job_->writes.clear();
+      job_->samples.clear();
+      primeSilence();
+    } else {
+      // Catch the chip up with everything that was submitted, and
+      // drop the blocks of audio that were rendered ahead.
+      job_->unlock();
+      while (!job_->writes.empty()) {
+	while (job_->samples.front()) {
+	  job_->samples.pop();
+	}
+	job_->renderPending();
+      }
+      job_->lock();
+      chip_ = job_->chip;
+      for (unsigned int i = 0; i < pending_.size; ++i) {
+	OPLRenderJob::apply(chip_, pending_.regs[i], pending_.values[i], rate_);
+      }
+      pending_.size = 0;
+      current_ = nullptr;
+    }
+    job_->unlock();
+    pipelined_ = requested;
+  }
+
+  void submit() {
+    OPLRenderJob::WriteBlock* block;
+    while (!(block = job_->writes.back())) {
+      job_->renderPending();
+    }
+    block->rate = rate_;
+    block->split = pending_.split;
+    block->size = pending_.size;
+    memcpy(block->regs, pending_.regs, pending_.size * sizeof(pending_.regs[0]));
+    memcpy(block->values, pending_.values, pending_.size * sizeof(pending_.values[0]));
+    memcpy(block->offsets, pending_.offsets, pending_.size * sizeof(pending_.offsets[0]));
+    job_->writes.push();
+    pending_.size = 0;
+    pending_.split = false;
+    RenderWorker::get().wake();
+
+    // Move on to the block submitted one block ago. If the worker
+    // didn't get to it in time, render it on this thread rather than
+    // drop out.
+    job_->samples.pop();
+    while (!(current_ = job_->samples.front())) {
+      if (!job_->renderPending()) {
+	std::this_thread::yield();
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PARAMSNAPSHOT_HPP
+#define PARAMSNAPSHOT_HPP
+
+#include <atomic>
+#include <cstring>
+
+// A double-buffered copy of a module's parameter values, published
+// by the UI thread and consumed by the engine thread.
+//
+// The sequence counter works like a seqlock: it is odd while the
+// writer fills a buffer, and publishing sequence 2n fills buffer n & 1.
+// The reader copies the buffer of the last complete publish and checks
+// the counter again. If the writer started filling that same buffer in
+// the meantime, which takes two more publishes, the copy may be torn,
+// so it is discarded and the reader keeps its previous values. Neither
+// side ever blocks.
+template<unsigned int N>
+struct ParamSnapshot {
+  float values[N];
+
+  ParamSnapshot() {
+    memset(values, 0, sizeof(values));
+  }
+
+  // Single writer only.
+  void publish(const float* src) {
+    unsigned int s = seq_.load(std::memory_order_relaxed);
+    seq_.store(s + 1, std::memory_order_relaxed);
+    // A reader that sees any of the writes below also sees the odd
+    // counter.
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(buffers_[(s / 2 + 1) & 1], src, sizeof(values));
+    seq_.store(s + 2, std::memory_order_release);
+  }
+
+  // Single reader only. Returns true if values were updated.
+  bool consume() {
+    unsigned int s = seq_.load(std::memory_order_acquire) & ~1u;
+    if (s == consumed_) {
+      return false;
+    }
+    float tmp[N];
+    memcpy(tmp, buffers_[(s / 2) & 1], sizeof(tmp));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // s + 3 is the writer starting on the buffer that was just copied.
+    if (seq_.load(std::memory_order_relaxed) - s > 2) {
+      return false; // Torn, try again next time
+    }
+    memcpy(values, tmp, sizeof(values));
+    consumed_ = s;
+    return true;
+  }
+
+private:
+  float buffers_[2][N] = {};
+  std::atomic<unsigned int> seq_{0};
+  unsigned int consumed_ = 0;
+};
+
+#endif
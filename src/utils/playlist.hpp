@@ -0,0 +1,66 @@
+#ifndef PLAYLIST_HPP
+#define PLAYLIST_HPP
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace Playlist {
+
+  // Returns true if AdPlug has a player registered for the extension
+  // of this file. This is only a hint, AdPlug may still fail to load
+  // the file.
+  static bool isTrack(const std::string& path) {
+    for (auto const& r : CAdPlug::players) {
+      unsigned int i = 0;
+      const char* ext;
+      while ((ext = r->get_extension(i++))) {
+	if (CFileProvider::extension(path, ext)) {
+	  return true;
+	}
+      }
+    }
+    return false;
+  }
+
+  static bool isM3U(const std::string& path) {
+    return CFileProvider::extension(path, ".m3u") || CFileProvider::extension(path, ".m3u8");
+  }
+
+  // All tracks in a directory, sorted by name.
+  static std::vector<std::string> fromDirectory(const std::string& dir) {
+    std::vector<std::string> tracks;
+    for (const std::string& entry : systemListEntries(dir)) {
+      if (systemIsFile(entry) && isTrack(entry)) {
+	tracks.push_back(entry);
+      }
+    }
+    std::sort(tracks.begin(), tracks.end());
+    return tracks;
+  }
+
+  // All entries of an M3U playlist, in order. Relative paths are
+  // resolved against the directory of the playlist.
+  static std::vector<std::string> fromM3U(const std::string& path) {
+    std::vector<std::string> tracks;
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+      while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+	line.pop_back();
+      }
+      if (line.empty() || line[0] == '#') {
+	continue;
+      }
+      if (line[0] != '/' && line.find(":\\") == std::string::npos) {
+	line = stringDirectory(path) + "/" + line;
+      }
+      tracks.push_back(line);
+    }
+    return tracks;
+  }
+
+}; // namespace Playlist
+
+#endif
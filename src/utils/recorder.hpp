@@ -0,0 +1,303 @@
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include "osdialog.h"
+#include "spscring.hpp"
+
+// rack.hpp must be included before this file.
+
+// Records a module's output to a 16-bit stereo WAV file. The engine
+// thread hands over raw chip samples through a ring of blocks, and a
+// writer thread converts and writes them through a large stdio buffer,
+// so recording never allocates or touches the disk on the engine
+// thread. The ring is only allocated, on the UI thread, while
+// recording. If the writer falls more than kRingBlocks blocks behind,
+// whole blocks are dropped and counted as overruns.
+struct Recorder {
+  static const unsigned int kBlockFrames = 256;
+  // About 1.5s of audio at 44.1kHz.
+  static const unsigned int kRingBlocks = 256;
+  static const size_t kFileBufferSize = 1 << 20;
+  // WAV sizes are 32 bits.
+  static const uint64_t kMaxDataBytes = 0xffffffffu - 36;
+
+  enum State {
+    IDLE,
+    RECORDING,
+    // Asked to stop, waiting for the engine thread to push its last
+    // partial block.
+    STOPPING,
+    FLUSHED,
+  };
+
+  ~Recorder() {
+    stop();
+  }
+
+  // Engine thread. Takes samples as rendered by the chip, where
+  // 0x7fff is full scale.
+  void write(int32_t left, int32_t right) {
+    int state = state_.load(std::memory_order_acquire);
+    if (state == IDLE) {
+      return;
+    }
+    unsigned int session = session_.load(std::memory_order_relaxed);
+    if (session != engineSession_) {
+      engineSession_ = session;
+      block_ = nullptr;
+      frames_ = 0;
+    }
+    if (state == STOPPING) {
+      if (block_ && frames_ > 0) {
+	block_->frames = frames_;
+	ring_->push();
+      }
+      block_ = nullptr;
+      frames_ = 0;
+      int expected = STOPPING;
+      state_.compare_exchange_strong(expected, FLUSHED, std::memory_order_release);
+      return;
+    }
+    if (state != RECORDING) {
+      return;
+    }
+    if (frames_ == 0) {
+      block_ = ring_->back();
+      if (!block_) {
+	overruns_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    if (block_) {
+      block_->samples[frames_ * 2] = left;
+      block_->samples[frames_ * 2 + 1] = right;
+    }
+    if (++frames_ == kBlockFrames) {
+      if (block_) {
+	block_->frames = frames_;
+	ring_->push();
+      }
+      block_ = nullptr;
+      frames_ = 0;
+    }
+  }
+
+  // The methods below are called from the UI thread.
+
+  bool start(const std::string& path, unsigned int rate) {
+    if (isRecording()) {
+      return false;
+    }
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_) {
+      return false;
+    }
+    setvbuf(file_, nullptr, _IOFBF, kFileBufferSize);
+    rate_ = rate;
+    writeHeader(0);
+    if (!ring_) {
+      ring_.reset(new SpscRing<Block, kRingBlocks>());
+    }
+    ring_->clear();
+    overruns_ = 0;
+    writtenFrames_ = 0;
+    failed_ = false;
+    flushed_ = false;
+    session_++;
+    state_.store(RECORDING, std::memory_order_release);
+    writer_ = std::thread(&Recorder::runWriter, this);
+    return true;
+  }
+
+  void stop() {
+    int expected = RECORDING;
+    state_.compare_exchange_strong(expected, STOPPING);
+    if (writer_.joinable()) {
+      writer_.join();
+      // Once it has flushed, the engine thread doesn't touch the ring
+      // again. If the writer gave up waiting for it, it may still be
+      // in write(), so the ring is kept for the next recording.
+      if (flushed_) {
+	ring_.reset();
+      }
+    }
+  }
+
+  bool isRecording() const {
+    return writer_.joinable();
+  }
+
+  unsigned int overruns() const {
+    return overruns_.load(std::memory_order_relaxed);
+  }
+
+  float seconds() const {
+    return rate_ ? (float)writtenFrames_.load(std::memory_order_relaxed) / rate_ : 0.f;
+  }
+
+  // Set when the file couldn't be written to, for example because the
+  // disk is full.
+  bool failed() const {
+    return failed_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Block {
+    int32_t samples[kBlockFrames * 2];
+    unsigned int frames;
+  };
+
+  // About 512kB, only used when the state isn't IDLE.
+  std::unique_ptr<SpscRing<Block, kRingBlocks>> ring_;
+  std::atomic<int> state_{IDLE};
+  std::atomic<unsigned int> overruns_{0};
+  std::atomic<uint64_t> writtenFrames_{0};
+  std::atomic<bool> failed_{false};
+  // Lets the engine thread notice a new recording even if it missed
+  // the end of the previous one.
+  std::atomic<unsigned int> session_{0};
+  std::thread writer_;
+  FILE* file_ = nullptr;
+  unsigned int rate_ = 0;
+  // Set by the writer thread when the engine thread acknowledged the
+  // stop, read after joining it.
+  bool flushed_ = false;
+
+  // Engine thread only.
+  unsigned int engineSession_ = 0;
+  Block* block_ = nullptr;
+  unsigned int frames_ = 0;
+
+  static void put16(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+  }
+
+  static void put32(uint8_t* p, uint32_t v) {
+    put16(p, v & 0xffff);
+    put16(p + 2, v >> 16);
+  }
+
+  void writeHeader(uint32_t dataBytes) {
+    uint8_t header[44] = {
+      'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+      'f', 'm', 't', ' ', 16, 0, 0, 0,
+    };
+    put32(header + 4, 36 + dataBytes);
+    put16(header + 20, 1); // PCM
+    put16(header + 22, 2); // Channels
+    put32(header + 24, rate_);
+    put32(header + 28, rate_ * 4); // Bytes per second
+    put16(header + 32, 4); // Bytes per frame
+    put16(header + 34, 16); // Bits per sample
+    memcpy(header + 36, "data", 4);
+    put32(header + 40, dataBytes);
+    fwrite(header, sizeof(header), 1, file_);
+  }
+
+  void drain(uint8_t* buffer) {
+    Block* block;
+    while ((block = ring_->front())) {
+      uint64_t frames = writtenFrames_.load(std::memory_order_relaxed);
+      unsigned int n = block->frames;
+      if ((frames + n) * 4 > kMaxDataBytes) {
+	// The rest doesn't fit in a WAV file.
+	overruns_.fetch_add(1, std::memory_order_relaxed);
+	n = 0;
+      }
+      for (unsigned int i = 0; i < n * 2; ++i) {
+	int32_t s = clamp(block->samples[i], -0x8000, 0x7fff);
+	put16(buffer + i * 2, (uint16_t)s);
+      }
+      ring_->pop();
+      if (n > 0 && fwrite(buffer, n * 4, 1, file_) != 1) {
+	failed_ = true;
+      }
+      writtenFrames_.store(frames + n, std::memory_order_relaxed);
+    }
+  }
+
+  void runWriter() {
+    uint8_t buffer[kBlockFrames * 4];
+    auto stopRequested = std::chrono::steady_clock::time_point::max();
+    while (true) {
+      drain(buffer);
+      int state = state_.load(std::memory_order_acquire);
+      if (state == FLUSHED) {
+	drain(buffer);
+	flushed_ = true;
+	break;
+      }
+      if (state == STOPPING) {
+	// The engine thread may not be running this module anymore,
+	// in which case the last partial block is lost.
+	auto now = std::chrono::steady_clock::now();
+	stopRequested = std::min(stopRequested, now);
+	if (now - stopRequested > std::chrono::milliseconds(200)) {
+	  int expected = STOPPING;
+	  if (state_.compare_exchange_strong(expected, IDLE)) {
+	    break;
+	  }
+	  continue;
+	}
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    fflush(file_);
+    fseek(file_, 0, SEEK_SET);
+    writeHeader((uint32_t)(writtenFrames_ * 4));
+    if (fclose(file_) != 0) {
+      failed_ = true;
+    }
+    file_ = nullptr;
+    state_.store(IDLE, std::memory_order_release);
+  }
+};
+
+// Adds the recording controls and status to a module's context menu.
+static void appendRecorderMenu(Menu* menu, Recorder* recorder) {
+  menu->addChild(MenuEntry::create());
+
+  struct RecordMenuItem : MenuItem {
+    Recorder* recorder;
+
+    void onAction(EventAction& e) override {
+      if (recorder->isRecording()) {
+	recorder->stop();
+	return;
+      }
+      char* path = osdialog_file(OSDIALOG_SAVE, nullptr, "OPL33t.wav", nullptr);
+      if (path) {
+	std::string p = path;
+	free(path);
+	if (stringExtension(p).empty()) {
+	  p += ".wav";
+	}
+	recorder->start(p, (unsigned int)engineGetSampleRate());
+      }
+    }
+  };
+
+  RecordMenuItem* record = MenuItem::create<RecordMenuItem>(recorder->isRecording() ? "Stop recording" : "Record to WAV...", "");
+  record->recorder = recorder;
+  menu->addChild(record);
+
+  if (recorder->isRecording() || recorder->seconds() > 0.f) {
+    unsigned int seconds = (unsigned int)recorder->seconds();
+    std::string status = stringf("%s %u:%02u, %u overruns", recorder->isRecording() ? "Recording" : "Recorded", seconds / 60, seconds % 60, recorder->overruns());
+    if (recorder->failed()) {
+      status += ", write error";
+    }
+    menu->addChild(MenuLabel::create(status));
+  }
+}
+
+#endif
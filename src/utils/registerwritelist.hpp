@@ -0,0 +1,47 @@
+#ifndef REGISTERWRITELIST_HPP
+#define REGISTERWRITELIST_HPP
+
+#include <cstdint>
+
+// An ordered list of OPL register writes with a fixed capacity, so it
+// can be filled on the engine thread without allocating. Modules
+// collect their writes in one of these and apply them to the chip
+// right before rendering, which makes the exact stream of writes
+// that produced a block of samples available for replay.
+template<unsigned int N>
+struct RegisterWriteList {
+  uint16_t regs[N];
+  uint8_t values[N];
+  unsigned int size = 0;
+
+  // Returns false if the list is full, in which case the write is
+  // dropped.
+  bool push(unsigned int reg, uint8_t value) {
+    if (size >= N) {
+      return false;
+    }
+    regs[size] = (uint16_t)reg;
+    values[size] = value;
+    size++;
+    return true;
+  }
+
+  void clear() {
+    size = 0;
+  }
+
+  bool empty() const {
+    return size == 0;
+  }
+
+  // Works with anything that has a WriteReg(reg, value) method, such
+  // as DBOPL::Handler.
+  template<typename Handler>
+  void applyTo(Handler& handler) const {
+    for (unsigned int i = 0; i < size; ++i) {
+      handler.WriteReg(regs[i], values[i]);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef SONGINDEX_HPP
+#define SONGINDEX_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "filecache.hpp"
+
+// AdPlug, including silentopl.h, must be included before this file.
+
+// AdPlug can only tell how long a track is by emulating all of it
+// (CPlayer::songlength()), which takes far too long to do on the
+// engine or UI thread. The SongIndexer computes the length of every
+// subsong of a track on a pool of worker threads, each with its own
+// player instance driving a silent OPL, and caches the results on
+// disk keyed by a hash of the file contents.
+
+// AdPlug gives up measuring a track after 10 minutes. Subsongs that
+// reach that limit are assumed to loop forever.
+static const unsigned long kSongLengthLimitMs = 600000;
+
+struct SongInfo {
+  struct Subsong {
+    // Time until the player first reports the end of the song,
+    // which is also the point where it loops back.
+    unsigned long lengthMs;
+    // False if the subsong never ended within kSongLengthLimitMs.
+    bool ends;
+  };
+
+  // Set by the indexer once all fields below are final. Readers
+  // must not look at anything else until this is true.
+  std::atomic<bool> ready{false};
+  bool valid = false;
+  uint64_t hash = 0;
+  std::vector<Subsong> subsongs;
+};
+
+struct SongIndexer {
+  // Returns the (possibly still pending) index entry for a track,
+  // scheduling it for indexing if it wasn't known yet.
+  std::shared_ptr<const SongInfo> lookup(const std::string& path) {
+    return schedule(path, true);
+  }
+
+  // Schedules a list of tracks for indexing, in order. The files are
+  // spread across all worker threads.
+  void indexFiles(const std::vector<std::string>& paths) {
+    for (const std::string& path : paths) {
+      schedule(path, false);
+    }
+  }
+
+  static SongIndexer& get() {
+    static SongIndexer indexer;
+    return indexer;
+  }
+
+  static uint64_t hashFile(const MappedFile& file) {
+    // 64-bit FNV-1a, which is plenty to tell tracks apart.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < file.size; ++i) {
+      h ^= file.data[i];
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<std::string, std::shared_ptr<SongInfo>>> queue_;
+  std::map<std::string, std::shared_ptr<SongInfo>> entries_;
+  std::vector<std::thread> workers_;
+  std::string cacheDir_;
+  bool stopping_ = false;
+
+  SongIndexer() : cacheDir_(assetLocal("OPL33t/songindex")) {
+    systemCreateDirectory(assetLocal("OPL33t"));
+    systemCreateDirectory(cacheDir_);
+    // Leave a core to the engine thread, like RenderWorker.
+    unsigned int n = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    for (unsigned int i = 0; i < n; ++i) {
+      workers_.emplace_back(&SongIndexer::run, this);
+    }
+  }
+
+  ~SongIndexer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      queue_.clear();
+    }
+    cv_.notify_all();
+    for (auto& w : workers_) {
+      w.join();
+    }
+  }
+
+  std::shared_ptr<SongInfo> schedule(const std::string& path, bool urgent) {
+    std::shared_ptr<SongInfo> info;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(path);
+      if (it != entries_.end()) {
+	if (urgent) {
+	  // The track may be queued behind the rest of its directory.
+	  auto job = std::find_if(queue_.begin(), queue_.end(), [&](const std::pair<std::string, std::shared_ptr<SongInfo>>& j) {
+	      return j.second == it->second;
+	    });
+	  if (job != queue_.end() && job != queue_.begin()) {
+	    auto moved = std::move(*job);
+	    queue_.erase(job);
+	    queue_.push_front(std::move(moved));
+	  }
+	}
+	return it->second;
+      }
+      info = std::make_shared<SongInfo>();
+      entries_[path] = info;
+      // A track that was just loaded jumps ahead of directory scans.
+      if (urgent) {
+	queue_.emplace_front(path, info);
+      } else {
+	queue_.emplace_back(path, info);
+      }
+    }
+    cv_.notify_one();
+    return info;
+  }
+
+  void run() {
+    for (;;) {
+      std::pair<std::string, std::shared_ptr<SongInfo>> job;
+      {
+	std::unique_lock<std::mutex> lock(mutex_);
+	cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+	if (stopping_) {
+	  return;
+	}
+	job = std::move(queue_.front());
+	queue_.pop_front();
+      }
+      index(job.first, job.second.get());
+      job.second->ready.store(true, std::memory_order_release);
+    }
+  }
+
+  std::string cachePath(uint64_t hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.json", (unsigned long long)hash);
+    return cacheDir_ + name;
+  }
+
+  void index(const std::string& path, SongInfo* info) {
+    // Players loading the track share this mapping.
+    std::shared_ptr<const MappedFile> file = FileCache::acquire(path);
+    if (!file) {
+      return;
+    }
+    info->hash = hashFile(*file);
+    if (loadCached(info)) {
+      return;
+    }
+
+    CSilentopl opl;
+    CProvider_Mapped provider;
+    CPlayer* player = loadTrack(path, &opl, provider);
+    if (!player) {
+      return;
+    }
+    unsigned int n = std::max(1u, player->getsubsongs());
+    for (unsigned int i = 0; i < n; ++i) {
+      unsigned long ms = player->songlength(i);
+      info->subsongs.push_back(SongInfo::Subsong{ms, ms < kSongLengthLimitMs});
+    }
+    delete player;
+    info->valid = true;
+    saveCached(*info);
+  }
+
+  bool loadCached(SongInfo* info) {
+    json_error_t error;
+    json_t* rootJ = json_load_file(cachePath(info->hash).c_str(), 0, &error);
+    if (!rootJ) {
+      return false;
+    }
+    json_t* subsongsJ = json_object_get(rootJ, "subsongs");
+    size_t i;
+    json_t* subsongJ;
+    json_array_foreach(subsongsJ, i, subsongJ) {
+      info->subsongs.push_back(SongInfo::Subsong{
+	  (unsigned long)json_integer_value(json_object_get(subsongJ, "length")),
+	    json_is_true(json_object_get(subsongJ, "ends")) != 0,
+	    });
+    }
+    json_decref(rootJ);
+    info->valid = !info->subsongs.empty();
+    return info->valid;
+  }
+
+  void saveCached(const SongInfo& info) {
+    json_t* rootJ = json_object();
+    json_t* subsongsJ = json_array();
+    for (const auto& s : info.subsongs) {
+      json_t* subsongJ = json_object();
+      json_object_set_new(subsongJ, "length", json_integer(s.lengthMs));
+      json_object_set_new(subsongJ, "ends", json_boolean(s.ends));
+      json_array_append_new(subsongsJ, subsongJ);
+    }
+    json_object_set_new(rootJ, "subsongs", subsongsJ);
+    json_dump_file(rootJ, cachePath(info.hash).c_str(), JSON_COMPACT);
+    json_decref(rootJ);
+  }
+};
+
+#endif
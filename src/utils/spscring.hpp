@@ -0,0 +1,57 @@
+#ifndef SPSCRING_HPP
+#define SPSCRING_HPP
+
+#include <atomic>
+
+// A fixed-size lock-free ring buffer for one producer thread and one
+// consumer thread. Items are filled and read in place: the producer
+// gets a slot with back(), fills it and publishes it with push(); the
+// consumer reads front() and releases it with pop().
+template<typename T, unsigned int N>
+struct SpscRing {
+  static_assert((N & (N - 1)) == 0, "Ring size must be a power of 2");
+
+  // Producer side. Returns nullptr if the ring is full.
+  T* back() {
+    unsigned int h = head_.load(std::memory_order_relaxed);
+    if (h - tail_.load(std::memory_order_acquire) == N) {
+      return nullptr;
+    }
+    return &items_[h % N];
+  }
+
+  void push() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Consumer side. Returns nullptr if the ring is empty.
+  T* front() {
+    unsigned int t = tail_.load(std::memory_order_relaxed);
+    if (t == head_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &items_[t % N];
+  }
+
+  void pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // A hint only: the answer may be stale by the time it's used.
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+
+  // Only when neither side is in use.
+  void clear() {
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  T items_[N];
+  std::atomic<unsigned int> head_{0};
+  std::atomic<unsigned int> tail_{0};
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef FM6X4STREAM_HPP
+#define FM6X4STREAM_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "oplregisters.hpp"
+#include "fm6x4patch.hpp"
+#include "utils/registerwritelist.hpp"
+
+// Register-write streams for the render tests and benchmarks.
+
+// A write to make before rendering a given sample.
+struct Write {
+  uint32_t sample;
+  uint16_t reg;
+  uint8_t value;
+};
+typedef std::vector<Write> Stream;
+
+// Pseudo-register that reinitializes the chip.
+static const uint16_t kResetChip = 0xffff;
+static const unsigned int kRate = 44100;
+
+inline void append(Stream& stream, uint32_t sample, const RegisterWriteList<1024>& writes) {
+  for (unsigned int i = 0; i < writes.size; ++i) {
+    stream.push_back({sample, writes.regs[i], writes.values[i]});
+  }
+}
+
+// Programs the chip through FM6x4Patch, the same code as FM6x4: its
+// initial registers, then parameter groups spread over the first
+// steps of each block and notes on the seventh. Parameters come from
+// params, with nothing learned.
+struct FM6x4Programmer {
+  float params[FM6x4Patch::NUM_SAVEABLE_PARAMS] = {};
+  bool gates[OPL3::kChannels] = {};
+
+  float paramValue(int param) const {
+    return params[param];
+  }
+
+  float paramModulation(int param, float maxvalue, unsigned int channel) const {
+    return 0.f;
+  }
+
+  void writeNote(unsigned int ch, bool gate, float cv, RegisterWriteList<1024>& writes) {
+    gates[ch] = gate;
+    FM6x4Patch::writeNote(ch, gate, cv, writes);
+  }
+
+  // Initial registers and the whole patch, as after a reset.
+  void writeReset(Stream& stream, uint32_t sample) const {
+    RegisterWriteList<1024> writes;
+    FM6x4Patch::programInitialRegisters(writes);
+    for (unsigned int group = 1; group <= 6; ++group) {
+      FM6x4Patch::writeRegisterGroup(group, *this, writes);
+    }
+    append(stream, sample, writes);
+  }
+
+  // Parameter groups for the block starting at sample.
+  void writeBlock(Stream& stream, uint32_t sample) const {
+    for (unsigned int group = 1; group <= 6; ++group) {
+      RegisterWriteList<1024> writes;
+      FM6x4Patch::writeRegisterGroup(group, *this, writes);
+      append(stream, sample + group - 1, writes);
+    }
+  }
+};
+
+inline float randomParam(std::mt19937& rng, unsigned int param) {
+  float max = 15.f;
+  if (param == FM6x4Patch::ALGORITHM_PARAM) {
+    max = 3.f;
+  } else if (param < FM6x4Patch::MULTI_PARAM) {
+    max = 1.f;
+  } else if (param >= FM6x4Patch::WAVEFORM_PARAM && param < FM6x4Patch::ATTACK_PARAM) {
+    max = 7.f;
+  }
+  return std::uniform_int_distribution<int>(0, (int)max)(rng);
+}
+
+// What FM6x4 sends with random knob moves and random notes.
+inline Stream fm6x4Stream(uint32_t seed, uint32_t samples) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  FM6x4Programmer fm;
+  for (unsigned int p = 0; p < FM6x4Patch::NUM_SAVEABLE_PARAMS; ++p) {
+    fm.params[p] = randomParam(rng, p);
+  }
+  Stream stream;
+  fm.writeReset(stream, 0);
+  for (uint32_t block = 32; block + 32 <= samples; block += 32) {
+    if (unit(rng) < 0.2f) {
+      unsigned int p = rng() % FM6x4Patch::NUM_SAVEABLE_PARAMS;
+      fm.params[p] = randomParam(rng, p);
+    }
+    fm.writeBlock(stream, block);
+    RegisterWriteList<1024> notes;
+    for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+      if (unit(rng) < 0.05f) {
+	fm.writeNote(ch, !fm.gates[ch], unit(rng) * 6.f - 3.f, notes);
+      }
+    }
+    append(stream, block + 6, notes);
+  }
+  return stream;
+}
+
+// Edge cases on top of an FM6x4 patch: key-on/off a few samples
+// apart and off block boundaries, 4-op (0x104) and OPL3 (0x105) mode
+// toggles while notes play, percussion mode, and a chip reset.
+inline Stream edgeStream(uint32_t seed, uint32_t samples) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  FM6x4Programmer fm;
+  for (unsigned int p = 0; p < FM6x4Patch::NUM_SAVEABLE_PARAMS; ++p) {
+    fm.params[p] = randomParam(rng, p);
+  }
+  Stream stream;
+  fm.writeReset(stream, 0);
+  // Nothing else happens in the block of the reset, which keeps it
+  // under the per-block write limit of pipelined mode.
+  uint32_t resetAt = (samples / 2) & ~31u;
+  bool reset = false;
+  for (uint32_t s = 1; s < samples; s += 1 + rng() % 3) {
+    if (s / 32 == resetAt / 32) {
+      if (!reset) {
+	reset = true;
+	stream.push_back({resetAt, kResetChip, 0});
+	fm.writeReset(stream, resetAt);
+      }
+      continue;
+    }
+    RegisterWriteList<1024> writes;
+    unsigned int ch = rng() % OPL3::kChannels;
+    fm.writeNote(ch, !fm.gates[ch], unit(rng) * 6.f - 3.f, writes);
+    float event = unit(rng);
+    if (event < 0.01f) {
+      writes.push(0x104, rng() & 0x3f);
+    } else if (event < 0.02f) {
+      writes.push(0x105, rng() & 1);
+    } else if (event < 0.025f) {
+      writes.push(0xBD, rng() & 0xff);
+    }
+    append(stream, s, writes);
+  }
+  return stream;
+}
+
+// Arbitrary writes anywhere in both register sets.
+inline Stream randomStream(uint32_t seed, uint32_t samples) {
+  std::mt19937 rng(seed);
+  Stream stream;
+  stream.push_back({0, 0x105, 0x01});
+  for (uint32_t s = 0; s < samples; ++s) {
+    unsigned int n = rng() % 64 == 0 ? rng() % 8 : 0;
+    for (unsigned int i = 0; i < n; ++i) {
+      stream.push_back({s, (uint16_t)(rng() % 0x200), (uint8_t)rng()});
+    }
+  }
+  return stream;
+}
+
+#endif
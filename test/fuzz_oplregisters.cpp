@@ -0,0 +1,25 @@
+#include <cstring>
+#include "oplregisters_checks.hpp"
+
+// libFuzzer entry point over Note::computeOPLParamsFromCV and the
+// register structs. Build with `make fuzz`, which needs clang.
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  if (size < sizeof(float) + 8) {
+    return 0;
+  }
+  float cv;
+  memcpy(&cv, data, sizeof(cv));
+  const uint8_t* b = data + sizeof(cv);
+  checkNote(cv);
+  checkOperatorConfigEffects(b[0], b[1], b[2], b[3], b[4]);
+  checkOperatorConfigLevels(b[0], b[1]);
+  checkOperatorConfigAtkDec(b[2], b[3]);
+  checkOperatorConfigSusRel(b[4], b[5]);
+  checkOperatorConfigWaveform(b[6]);
+  checkChannelConfigNote(b[0], b[1], b[2], b[3]);
+  checkChannelConfigSynthesis(b[4], b[5], b[6], b[7], b[0], b[1]);
+  checkOperatorRegister(0x20 + (b[0] % 7) * 0x20, b[1] % 36);
+  checkChannelRegister(0xA0 + (b[2] % 3) * 0x10, b[3] % 18);
+  return 0;
+}
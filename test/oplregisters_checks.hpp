@@ -0,0 +1,138 @@
+#ifndef OPLREGISTERS_CHECKS_HPP
+#define OPLREGISTERS_CHECKS_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include "oplregisters.hpp"
+
+// Invariants of the helpers in oplregisters.hpp, shared by the unit
+// test, which calls them exhaustively or over sweeps, and the fuzzer.
+
+#define CHECK(cond) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      abort();								\
+    }									\
+  } while (0)
+
+// The pitch must land in the lowest block that can hold it, and the
+// frequency number must be the closest one below it.
+static void checkNote(float cv) {
+  OPL3::Note n{};
+  bool ok = n.computeOPLParamsFromCV(cv);
+  float hz = n.CV2Hz(cv);
+  if (!(hz < OPL3::kBlockHighestHz[7])) { // Also catches NaN
+    CHECK(!ok);
+    return;
+  }
+  CHECK(ok);
+  CHECK(n.block < 8);
+  CHECK(n.freqHi < 4);
+  CHECK(hz < OPL3::kBlockHighestHz[n.block]);
+  CHECK(n.block == 0 || hz >= OPL3::kBlockHighestHz[n.block - 1]);
+  float interval = OPL3::kBlockIntervalHz[n.block];
+  unsigned int freq = n.freqLo | (n.freqHi << 8);
+  CHECK(freq * interval <= hz * 1.0001f);
+  CHECK(hz - freq * interval < interval * 1.0001f);
+}
+
+static void checkOperatorConfigEffects(uint8_t tremolo, uint8_t vibrato, uint8_t sustain, uint8_t ksr, uint8_t multi) {
+  OPL3::OperatorConfigEffects o{};
+  o.tremolo = tremolo;
+  o.vibrato = vibrato;
+  o.sustain = sustain;
+  o.ksr = ksr;
+  o.multi = multi;
+  CHECK(o.value() == (((tremolo & 1) << 7) | ((vibrato & 1) << 6) | ((sustain & 1) << 5) | ((ksr & 1) << 4) | (multi & 0xf)));
+}
+
+static void checkOperatorConfigLevels(uint8_t ksl, uint8_t level) {
+  OPL3::OperatorConfigLevels o{};
+  o.ksl = ksl;
+  o.level = level;
+  CHECK(o.value() == (((ksl & 3) << 6) | (level & 0x3f)));
+}
+
+static void checkOperatorConfigAtkDec(uint8_t attack, uint8_t decay) {
+  OPL3::OperatorConfigAtkDec o{};
+  o.attack = attack;
+  o.decay = decay;
+  CHECK(o.value() == (((attack & 0xf) << 4) | (decay & 0xf)));
+}
+
+static void checkOperatorConfigSusRel(uint8_t sustain, uint8_t release) {
+  OPL3::OperatorConfigSusRel o{};
+  o.sustain = sustain;
+  o.release = release;
+  CHECK(o.value() == (((sustain & 0xf) << 4) | (release & 0xf)));
+}
+
+static void checkOperatorConfigWaveform(uint8_t waveform) {
+  OPL3::OperatorConfigWaveform o{};
+  o.waveform = waveform;
+  CHECK(o.value() == (waveform & 7));
+}
+
+static void checkChannelConfigNote(uint8_t freqlow, uint8_t keyon, uint8_t block, uint8_t freqhi) {
+  OPL3::ChannelConfigNote o{};
+  o.A.freqlow8bits = freqlow;
+  o.B.keyon = keyon;
+  o.B.block = block;
+  o.B.freqhi2bits = freqhi;
+  CHECK(o.A.value() == freqlow);
+  CHECK(o.B.value() == (((keyon & 1) << 5) | ((block & 7) << 2) | (freqhi & 3)));
+  CHECK(o.B.value() < 0x40);
+}
+
+static void checkChannelConfigSynthesis(uint8_t d, uint8_t c, uint8_t r, uint8_t l, uint8_t feedback, uint8_t synthtype) {
+  OPL3::ChannelConfigSynthesis o{};
+  o.outch_d = d;
+  o.outch_c = c;
+  o.outch_r = r;
+  o.outch_l = l;
+  o.feedback = feedback;
+  o.synthtype = synthtype;
+  CHECK(o.value() == (((d & 1) << 7) | ((c & 1) << 6) | ((r & 1) << 5) | ((l & 1) << 4) | ((feedback & 7) << 1) | (synthtype & 1)));
+}
+
+// Operators 0-17 are in the first register set, 18-35 in the second.
+// Within a set, operator registers skip offsets 6-7 and 14-15.
+static void checkOperatorRegister(unsigned int base, unsigned int op) {
+  unsigned int reg = OPL3::OperatorRegister(base, op);
+  unsigned int local = op % 18;
+  CHECK((reg >= 0x100) == (op >= 18));
+  CHECK((reg & 0xff) == base + (local / 6) * 8 + local % 6);
+}
+
+static void checkChannelRegister(unsigned int base, unsigned int ch) {
+  unsigned int reg = OPL3::ChannelRegister(base, ch);
+  CHECK((reg >= 0x100) == (ch >= 9));
+  CHECK((reg & 0xff) == base + ch % 9);
+}
+
+// Every register address must be used by a single operator or
+// channel, and the operators FM6x4 writes for each of its channels
+// must belong to that channel's 4-op pair.
+static void checkRegisterLayout() {
+  std::set<unsigned int> regs;
+  for (unsigned int op = 0; op < 36; ++op) {
+    checkOperatorRegister(0x20, op);
+    CHECK(regs.insert(OPL3::OperatorRegister(0x20, op)).second);
+  }
+  regs.clear();
+  for (unsigned int ch = 0; ch < 18; ++ch) {
+    checkChannelRegister(0xA0, ch);
+    CHECK(regs.insert(OPL3::ChannelRegister(0xA0, ch)).second);
+  }
+  for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+    for (unsigned int op = 0; op < OPL3::FourOP::kOperatorsPerChannel; ++op) {
+      unsigned int hwop = OPL3::FourOP::kHWOperatorForChannel[ch] + 3 * op;
+      unsigned int local = hwop % 18;
+      unsigned int channel = (hwop / 18) * 9 + (local / 6) * 3 + local % 3;
+      CHECK(channel == OPL3::FourOP::kHWChannels[ch] + (op < 2 ? 0 : 3));
+    }
+  }
+}
+
+#endif
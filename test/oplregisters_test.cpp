@@ -0,0 +1,36 @@
+#include <random>
+#include "oplregisters_checks.hpp"
+
+// Exhaustive and swept checks of oplregisters.hpp. The same checks
+// run under libFuzzer in fuzz_oplregisters.cpp.
+
+int main() {
+  for (int cv = -12000; cv <= 12000; ++cv) {
+    checkNote(cv / 1200.f);
+  }
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> anyCV(-20.f, 20.f);
+  for (int i = 0; i < 1000000; ++i) {
+    checkNote(anyCV(rng));
+  }
+  checkNote(0.f / 0.f);
+  checkNote(1.f / 0.f);
+  checkNote(-1.f / 0.f);
+
+  // Every combination of fields, including values that overflow them.
+  for (unsigned int v = 0; v < 256; ++v) {
+    checkOperatorConfigEffects(v >> 7, v >> 6, v >> 5, v >> 4, v);
+    checkOperatorConfigEffects(v, v, v, v, v);
+    checkOperatorConfigLevels(v >> 6, v);
+    checkOperatorConfigLevels(v, v);
+    checkOperatorConfigAtkDec(v >> 4, v);
+    checkOperatorConfigSusRel(v >> 4, v);
+    checkOperatorConfigWaveform(v);
+    checkChannelConfigNote(v, v >> 5, v >> 2, v);
+    checkChannelConfigSynthesis(v >> 7, v >> 6, v >> 5, v >> 4, v >> 1, v);
+  }
+
+  checkRegisterLayout();
+  printf("oplregisters_test: OK\n");
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch"
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+#include "deps/adlmidi/src/dbopl.h"
+#pragma GCC diagnostic pop
+
+#include "utils/chipprototype.hpp"
+#include "fm6x4stream.hpp"
+
+// Compares the two ways of getting a chip in FM6x4's initial state:
+// copying the ChipPrototypes prototype, and Init() followed by writing
+// every initial register. With 40 chips or so, the totals are what
+// loading a patch of that many FM6x4 instances costs.
+//
+//   prototype_bench [chips]
+
+typedef std::chrono::steady_clock Clock;
+
+static void programInitialRegisters(DBOPL::Handler& opl) {
+  RegisterWriteList<1024> writes;
+  FM6x4Patch::programInitialRegisters(writes);
+  for (unsigned int i = 0; i < writes.size; ++i) {
+    opl.WriteReg(writes.regs[i], writes.values[i]);
+  }
+}
+
+static double microsecondsPerChip(Clock::duration d, unsigned int chips) {
+  return std::chrono::duration<double, std::micro>(d).count() / chips;
+}
+
+static double milliseconds(Clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+int main(int argc, char** argv) {
+  unsigned int chips = argc > 1 ? atoi(argv[1]) : 1000;
+  // Heap allocated like the modules that own them, and kept alive so
+  // that none of the work can be skipped.
+  std::vector<std::unique_ptr<DBOPL::Handler>> programmed(chips), copied(chips);
+
+  Clock::time_point start = Clock::now();
+  for (auto& chip : programmed) {
+    chip.reset(new DBOPL::Handler());
+    chip->Init(kRate);
+    programInitialRegisters(*chip);
+  }
+  Clock::duration programming = Clock::now() - start;
+
+  start = Clock::now();
+  const DBOPL::Handler& prototype = ChipPrototypes::get(kRate, programInitialRegisters);
+  for (auto& chip : copied) {
+    chip.reset(new DBOPL::Handler(prototype));
+  }
+  Clock::duration copying = Clock::now() - start;
+
+  printf("%u chips, per chip and in total:\n", chips);
+  printf("  Init + 0x300 writes  %8.2f us  %8.2f ms\n", microsecondsPerChip(programming, chips), milliseconds(programming));
+  printf("  prototype copy       %8.2f us  %8.2f ms (including building the prototype)\n", microsecondsPerChip(copying, chips), milliseconds(copying));
+  printf("  sizeof(DBOPL::Handler) = %zu\n", sizeof(DBOPL::Handler));
+  return 0;
+}
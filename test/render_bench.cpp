@@ -0,0 +1,68 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch"
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+#include "deps/adlmidi/src/dbopl.h"
+#pragma GCC diagnostic pop
+
+#include "utils/oplrenderer.hpp"
+#include "fm6x4stream.hpp"
+
+// Measures how much time the engine thread spends in OPLRenderer for
+// a number of FM6x4 instances, inline and pipelined. Like Rack's
+// engine, it runs in real time, a buffer of kBufferSize samples at a
+// time, and only the time spent producing the samples is counted.
+//
+//   render_bench [instances] [seconds]
+
+typedef std::chrono::steady_clock Clock;
+
+static const unsigned int kBufferSize = 256;
+
+// Returns the engine thread's busy time as a fraction of real time.
+static double run(unsigned int instances, uint32_t samples, bool pipelined) {
+  std::vector<std::unique_ptr<OPLRenderer>> chips;
+  std::vector<Stream> streams;
+  std::vector<size_t> next(instances, 0);
+  for (unsigned int i = 0; i < instances; ++i) {
+    chips.emplace_back(new OPLRenderer(kRate));
+    chips.back()->setPipelined(pipelined);
+    streams.push_back(fm6x4Stream(i + 1, samples));
+  }
+  Clock::duration busy{0};
+  Clock::time_point start = Clock::now();
+  for (uint32_t s = 0; s < samples; s += kBufferSize) {
+    Clock::time_point begin = Clock::now();
+    for (uint32_t t = s; t < std::min(s + kBufferSize, samples); ++t) {
+      for (unsigned int i = 0; i < instances; ++i) {
+	const Stream& stream = streams[i];
+	for (size_t& w = next[i]; w < stream.size() && stream[w].sample <= t; ++w) {
+	  chips[i]->WriteReg(stream[w].reg, stream[w].value);
+	}
+	int32_t buf[2];
+	chips[i]->generate(buf);
+      }
+    }
+    busy += Clock::now() - begin;
+    std::this_thread::sleep_until(start + std::chrono::microseconds((uint64_t)(s + kBufferSize) * 1000000 / kRate));
+  }
+  Clock::duration elapsed = Clock::now() - start;
+  return std::chrono::duration<double>(busy).count() / std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char** argv) {
+  unsigned int instances = argc > 1 ? atoi(argv[1]) : 8;
+  double seconds = argc > 2 ? atof(argv[2]) : 5.;
+  uint32_t samples = (uint32_t)(seconds * kRate);
+  double inlineLoad = run(instances, samples, false);
+  double pipelinedLoad = run(instances, samples, true);
+  printf("%u instances, %.1f s at %u Hz, engine thread busy:\n", instances, seconds, kRate);
+  printf("  inline     %5.1f%%\n", inlineLoad * 100);
+  printf("  pipelined  %5.1f%%\n", pipelinedLoad * 100);
+  return 0;
+}
@@ -0,0 +1,297 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch"
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+#include "deps/adlmidi/src/dbopl.h"
+#pragma GCC diagnostic pop
+
+#include "utils/oplrenderer.hpp"
+#include "fm6x4stream.hpp"
+
+// Feeds register-write streams to plain DBOPL and to every
+// OPLRenderer mode, and checks that they produce bit-identical
+// samples. Also renders the FM6x4 patch of references/testpatch.vcv
+// and compares it with golden.txt.
+//
+//   render_test                  runs all checks
+//   render_test --update-golden  rewrites golden.txt
+
+typedef std::vector<int32_t> Samples; // Interleaved stereo
+
+static const char* kTestPatch = "../references/testpatch.vcv";
+static const char* kGolden = "golden.txt";
+
+static void apply(DBOPL::Handler& chip, const Write& w) {
+  if (w.reg == kResetChip) {
+    chip.Init(kRate);
+  } else {
+    chip.WriteReg(w.reg, w.value);
+  }
+}
+
+// The reference: plain DBOPL, rendering everything between two groups
+// of writes at once. Like DBOPL::Handler::Generate, it renders mono
+// samples with GenerateBlock2 in OPL2 mode and copies them to both
+// sides.
+static Samples renderReference(const Stream& stream, uint32_t samples) {
+  DBOPL::Handler chip;
+  chip.Init(kRate);
+  Samples out(samples * 2);
+  Samples mono(samples);
+  size_t w = 0;
+  for (uint32_t s = 0; s < samples; ) {
+    for (; w < stream.size() && stream[w].sample <= s; ++w) {
+      apply(chip, stream[w]);
+    }
+    uint32_t next = w < stream.size() ? std::min(stream[w].sample, samples) : samples;
+    if (chip.chip.opl3Active) {
+      chip.chip.GenerateBlock3(next - s, &out[s * 2]);
+    } else {
+      chip.chip.GenerateBlock2(next - s, &mono[s]);
+      for (uint32_t i = s; i < next; ++i) {
+	out[i * 2] = out[i * 2 + 1] = mono[i];
+      }
+    }
+    s = next;
+  }
+  return out;
+}
+
+// Renders through OPLRenderer one sample at a time, like the modules
+// do. Pipelined output is shifted back by the pipeline latency. If
+// channelSums isn't null, it receives the sum of the per-channel
+// outputs for each sample.
+static Samples renderWithRenderer(const Stream& stream, uint32_t samples, bool pipelined, bool split, std::vector<int32_t>* channelSums) {
+  OPLRenderer opl(kRate);
+  opl.setPipelined(pipelined);
+  unsigned int latency = pipelined ? OPLRenderer::kLatency : 0;
+  Samples out(samples * 2);
+  if (channelSums) {
+    channelSums->assign(samples, 0);
+  }
+  size_t w = 0;
+  for (uint32_t s = 0; s < samples + latency; ++s) {
+    for (; w < stream.size() && stream[w].sample <= s; ++w) {
+      if (stream[w].reg == kResetChip) {
+	opl.Init(kRate);
+      } else {
+	opl.WriteReg(stream[w].reg, stream[w].value);
+      }
+    }
+    int32_t buf[2];
+    int32_t channels[kChipChannels];
+    opl.generate(buf, split ? channels : nullptr);
+    if (s < latency) {
+      // Primed silence
+      if (buf[0] != 0 || buf[1] != 0) {
+	printf("  sample %u: expected pipeline silence, got %d %d\n", s, buf[0], buf[1]);
+	out[0] = ~0; // Make sure the comparison fails
+      }
+      continue;
+    }
+    uint32_t t = s - latency;
+    out[t * 2] = buf[0];
+    out[t * 2 + 1] = buf[1];
+    if (channelSums) {
+      for (unsigned int c = 0; c < kChipChannels; ++c) {
+	(*channelSums)[t] += channels[c];
+      }
+    }
+  }
+  return out;
+}
+
+static bool compare(const char* what, const Samples& expected, const Samples& actual) {
+  for (size_t i = 0; i < expected.size(); ++i) {
+    if (expected[i] != actual[i]) {
+      printf("FAIL %s: sample %zu (%s) is %d, expected %d\n", what, i / 2, i % 2 ? "right" : "left", actual[i], expected[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs one stream through every mode. With summable set, every
+// channel outputs on both sides or on none, so the per-channel outputs
+// must add up to the left output.
+static bool checkStream(const std::string& name, const Stream& stream, uint32_t samples, bool summable) {
+  Samples reference = renderReference(stream, samples);
+  bool ok = true;
+  for (int pipelined = 0; pipelined < 2; ++pipelined) {
+    for (int split = 0; split < 2; ++split) {
+      std::string what = name + (pipelined ? " pipelined" : " inline") + (split ? " split" : "");
+      std::vector<int32_t> sums;
+      Samples out = renderWithRenderer(stream, samples, pipelined, split, split ? &sums : nullptr);
+      bool same = compare(what.c_str(), reference, out);
+      if (same && split && summable) {
+	for (uint32_t s = 0; s < samples; ++s) {
+	  if (sums[s] != reference[s * 2]) {
+	    printf("FAIL %s: channels add up to %d at sample %u, left is %d\n", what.c_str(), sums[s], s, reference[s * 2]);
+	    same = false;
+	    break;
+	  }
+	}
+      }
+      ok = ok && same;
+    }
+  }
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name.c_str());
+  return ok;
+}
+
+// Reads the parameters of the FM6x4 module of a Rack patch. Enough of
+// a JSON parser for the files Rack writes.
+static bool loadFM6x4Params(const char* path, float* params) {
+  std::ifstream file(path);
+  std::stringstream ss;
+  ss << file.rdbuf();
+  std::string json = ss.str();
+  size_t pos = json.find("\"model\": \"FM6x4\"");
+  if (pos == std::string::npos || (pos = json.find("\"params\"", pos)) == std::string::npos) {
+    return false;
+  }
+  size_t end = json.find(']', pos);
+  while ((pos = json.find("\"paramId\"", pos)) < end) {
+    int id = atoi(json.c_str() + json.find(':', pos) + 1);
+    pos = json.find("\"value\"", pos);
+    float value = strtof(json.c_str() + json.find(':', pos) + 1, nullptr);
+    if (id >= 0 && id < FM6x4Patch::NUM_SAVEABLE_PARAMS) {
+      params[id] = value;
+    }
+  }
+  return true;
+}
+
+// The patch plays a chord, one note per channel, then lets it ring out.
+static Stream testPatchStream(const float* params, uint32_t samples) {
+  static const float kChord[OPL3::kChannels] = {0.f, 4.f / 12, 7.f / 12, 1.f, 1.f + 4.f / 12, 1.f + 7.f / 12};
+  FM6x4Programmer fm;
+  memcpy(fm.params, params, sizeof(fm.params));
+  Stream stream;
+  fm.writeReset(stream, 0);
+  for (uint32_t block = 32; block + 32 <= samples; block += 32) {
+    fm.writeBlock(stream, block);
+    RegisterWriteList<1024> notes;
+    for (unsigned int ch = 0; ch < OPL3::kChannels; ++ch) {
+      bool gate = block >= ch * kRate / 4 && block < 2 * kRate;
+      if (gate != fm.gates[ch]) {
+	fm.writeNote(ch, gate, kChord[ch], notes);
+      }
+    }
+    append(stream, block + 6, notes);
+  }
+  return stream;
+}
+
+// FNV-1a over little-endian integers.
+struct Hash {
+  uint64_t value = 0xcbf29ce484222325ull;
+
+  void add(uint32_t v, unsigned int bytes) {
+    for (unsigned int i = 0; i < bytes; ++i) {
+      value ^= (v >> (i * 8)) & 0xff;
+      value *= 0x100000001b3ull;
+    }
+  }
+
+  std::string str() const {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, value);
+    return buf;
+  }
+};
+
+static std::string hashSamples(const Samples& samples) {
+  Hash hash;
+  for (int32_t s : samples) {
+    hash.add((uint32_t)s, 4);
+  }
+  return hash.str();
+}
+
+static std::string hashStream(const Stream& stream) {
+  Hash hash;
+  for (const Write& w : stream) {
+    hash.add(w.sample, 4);
+    hash.add(w.reg, 2);
+    hash.add(w.value, 1);
+  }
+  return hash.str();
+}
+
+static bool checkGolden(bool update) {
+  float params[FM6x4Patch::NUM_SAVEABLE_PARAMS] = {};
+  if (!loadFM6x4Params(kTestPatch, params)) {
+    printf("FAIL no FM6x4 module in %s\n", kTestPatch);
+    return false;
+  }
+  uint32_t samples = 3 * kRate;
+  Stream stream = testPatchStream(params, samples);
+  // Every mode must match the reference, which is then compared with
+  // the golden render.
+  if (!checkStream("testpatch", stream, samples, true)) {
+    return false;
+  }
+  // The register writes are checked on their own too, so that a
+  // change in FM6x4Patch can be told apart from a change in DBOPL.
+  std::map<std::string, std::string> golden;
+  golden["testpatch"] = hashSamples(renderReference(stream, samples));
+  golden["testpatch-registers"] = hashStream(stream);
+
+  if (update) {
+    std::ofstream out(kGolden);
+    for (auto& g : golden) {
+      out << g.first << " " << g.second << "\n";
+    }
+    printf("wrote %s\n", kGolden);
+    return true;
+  }
+
+  std::ifstream in(kGolden);
+  if (!in) {
+    printf("FAIL no %s, run `make golden` to create it\n", kGolden);
+    return false;
+  }
+  std::map<std::string, std::string> expected;
+  std::string name, hash;
+  while (in >> name >> hash) {
+    expected[name] = hash;
+  }
+  bool ok = true;
+  for (auto& g : golden) {
+    auto e = expected.find(g.first);
+    bool same = e != expected.end() && e->second == g.second;
+    printf("%s golden %s\n", same ? "ok  " : "FAIL", g.first.c_str());
+    if (e == expected.end()) {
+      printf("  not in %s, run `make golden` to add it\n", kGolden);
+    } else if (!same) {
+      printf("  got %s, expected %s\n", g.second.c_str(), e->second.c_str());
+    }
+    ok = ok && same;
+  }
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  bool update = argc > 1 && !strcmp(argv[1], "--update-golden");
+  bool ok = true;
+  if (!update) {
+    const uint32_t samples = kRate * 2;
+    for (uint32_t seed = 1; seed <= 3; ++seed) {
+      ok = checkStream("fm6x4 seed " + std::to_string(seed), fm6x4Stream(seed, samples), samples, true) && ok;
+      ok = checkStream("edge seed " + std::to_string(seed), edgeStream(seed, samples), samples, true) && ok;
+      ok = checkStream("random seed " + std::to_string(seed), randomStream(seed, samples), samples, false) && ok;
+    }
+  }
+  ok = checkGolden(update) && ok;
+  printf("render_test: %s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}